@@ -1,10 +1,24 @@
+// madvise, mmap and MADV_HUGEPAGE are hidden by a strict -std=c11
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
-#include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(USE_PEXT) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 typedef int8_t i8;
 typedef int16_t i16;
@@ -20,6 +34,31 @@ typedef double f64;
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
+// Squares are indexed x + y * 8, so a1 = 0, h1 = 7 and h8 = 63
+#define SQUARE(x, y) ((x) + (y) * 8)
+#define SQUARE_X(square) ((square) & 7)
+#define SQUARE_Y(square) ((square) >> 3)
+#define SQUARE_BIT(square) (1ULL << (square))
+
+#define FILE_A 0x0101010101010101ULL
+#define FILE_B (FILE_A << 1)
+#define FILE_G (FILE_A << 6)
+#define FILE_H (FILE_A << 7)
+#define RANK_1 0xFFULL
+#define RANK_2 (RANK_1 << 8)
+#define RANK_7 (RANK_1 << 48)
+#define RANK_8 (RANK_1 << 56)
+
+#define POPCOUNT(bb) ((u32)__builtin_popcountll(bb))
+#define LSB(bb) ((u32)__builtin_ctzll(bb))
+
+// Returns the index of the lowest set bit and clears it
+static inline u32 pop_lsb(u64 *bb) {
+    u32 square = LSB(*bb);
+    *bb &= *bb - 1;
+    return square;
+}
+
 typedef enum {
     KING = 0x0,
     PAWN = 0x1,
@@ -29,63 +68,688 @@ typedef enum {
     QUEEN = 0x5
 } PieceType;
 
+#define PIECE_TYPE_COUNT 6
+
 typedef struct {
-    PieceType type;
+    // PieceType, stored as a byte to keep the mailbox small
+    u8 type;
 
     // 0 = white, 1 = black
     u8 color;
 } Piece;
 
-typedef struct {
-    struct {
-        u32 x, y;
-    } from, to;
+// Moves are packed into 16 bits: from square in bits 0-5, to square in
+// bits 6-11 and a flag nibble in bits 12-15
+typedef u16 Move;
+
+#define MOVE(from, to, flags) ((Move)((from) | ((to) << 6) | ((flags) << 12)))
+#define MOVE_FROM(move) ((move) & 0x3F)
+#define MOVE_TO(move) (((move) >> 6) & 0x3F)
+#define MOVE_FLAGS(move) ((move) >> 12)
+#define MOVE_NONE ((Move)0)
+
+#define FLAG_QUIET 0x0
+#define FLAG_DOUBLE_PUSH 0x1
+#define FLAG_KING_CASTLE 0x2
+#define FLAG_QUEEN_CASTLE 0x3
+#define FLAG_CAPTURE 0x4
+#define FLAG_EN_PASSANT 0x5
+// Promotions keep the promoted type, minus BISHOP, in the low two bits
+#define FLAG_PROMOTION 0x8
 
-    bool capture;
-} Move;
+#define MOVE_IS_CAPTURE(move) ((MOVE_FLAGS(move) & FLAG_CAPTURE) != 0)
+#define MOVE_IS_PROMOTION(move) ((MOVE_FLAGS(move) & FLAG_PROMOTION) != 0)
+#define MOVE_PROMOTION_TYPE(move) ((PieceType)((MOVE_FLAGS(move) & 0x3) + BISHOP))
 
 #define COLOR_WHITE 0
 #define COLOR_BLACK 1
 
+#define CASTLE_WHITE_KING 0x1
+#define CASTLE_WHITE_QUEEN 0x2
+#define CASTLE_BLACK_KING 0x4
+#define CASTLE_BLACK_QUEEN 0x8
+#define CASTLE_ALL 0xF
+
+#define NO_SQUARE 64
+
+// Width of the NNUE hidden layer, see the NNUE section
+#define NNUE_HIDDEN 256
+
 typedef struct {
-    Piece pieces[64];
+    // One bitboard per piece type and per color
+    u64 piece_bb[PIECE_TYPE_COUNT];
+    u64 color_bb[2];
+
+    // Union of color_bb, i.e. every occupied square
     u64 pieces_state;
 
-    struct {
-        u32 x, y;
-    } white_king_pos, black_king_pos;
+    // Mailbox for fast square lookups, only valid where pieces_state is set
+    Piece pieces[64];
+
+    u8 king_square[2];
+
+    // CASTLE_* bits still available
+    u8 castling_rights;
+
+    // Square a pawn can capture onto en passant, or NO_SQUARE. Only set when
+    // an enemy pawn is actually in place to make the capture
+    u8 ep_square;
+
+    u8 side_to_move;
+
+    // Half moves since the last capture or pawn move, and the number of the
+    // current full move, starting at 1 and incremented after black moves
+    u16 halfmove_clock;
+    u16 fullmove_number;
+
+    // Zobrist key, kept up to date by every function that changes the board
+    u64 hash;
+
+    // Running material plus piece-square sums, white minus black, for the
+    // middlegame and endgame, and the game phase used to blend them. Updated
+    // alongside hash
+    i32 psq_mg;
+    i32 psq_eg;
+    i32 phase;
+
+    // NNUE first-layer sums from white's and black's side, only maintained
+    // while a network is enabled
+    _Alignas(32) i16 accumulator[2][NNUE_HIDDEN];
 } Board;
 
-Board board = {0};
-Board search_board = {0};
+// Everything make_move overwrites, so unmake_move can restore it directly
+// instead of replaying the move backwards
+typedef struct {
+    Piece captured;
+    u8 king_square[2];
+    u8 castling_rights;
+    u8 ep_square;
+    u16 halfmove_clock;
+    u64 hash;
+    i32 psq_mg;
+    i32 psq_eg;
+    i32 phase;
+} Undo;
+
+#define MAX_MOVES 256
+#define MAX_PLY 128
+
+// Limits for one search. A zero field means no limit on that axis
+typedef struct {
+    i32 depth;
+    u64 nodes;
+    u64 time_ms;
+} SearchLimits;
+
+typedef struct {
+    Move move;
+    i32 score;
+    i32 depth;
+} SearchResult;
+
+// State shared by every search thread. stop is raised by whichever thread
+// first notices a limit, nodes collects the per-thread counts in batches.
+// While ponder is set the clock is not running: the time limit only starts
+// counting once ponderhit clears it and moves start_ms to that moment
+typedef struct {
+    SearchLimits limits;
+    _Atomic u64 start_ms;
+    _Atomic bool stop;
+    _Atomic bool ponder;
+    _Atomic u64 nodes;
+    // Positions answered by the endgame tablebases
+    _Atomic u64 tb_hits;
+
+    // Print UCI info lines after every iteration of the main thread.
+    // Their times count from go_ms, pondering included
+    bool report;
+    u64 go_ms;
+} SearchShared;
+
+// Search counters, kept per thread and summed once the search is over.
+// Builds without SEARCH_STATS leave them out entirely, STAT wraps every
+// statement that updates them
+#ifdef SEARCH_STATS
+typedef struct {
+    i32 depth;
+    // Main thread nodes and time since go when the iteration finished
+    u64 nodes;
+    u64 time_ms;
+} SearchIteration;
+
+typedef struct {
+    // Main search and quiescence nodes at every distance from the root
+    u64 nodes_by_ply[MAX_PLY + 1];
+    u64 qnodes;
+
+    // Main search nodes that searched at least one move, and how many of
+    // those failed high, in total and on their first move
+    u64 expanded_nodes;
+    u64 beta_cutoffs;
+    u64 first_move_cutoffs;
+
+    // Taken from the context, whose TT counters are kept in every build
+    u64 tt_probes;
+    u64 tt_hits;
+
+    SearchIteration iterations[MAX_PLY];
+    u32 iteration_count;
+} SearchStats;
+
+#define STAT(statement) statement
+#else
+#define STAT(statement)
+#endif
+
+// Per-thread search state. Every ply gets its own move list inside one
+// preallocated, cache-aligned block, so the search never touches the heap
+typedef struct {
+    _Alignas(64) Move move_stack[MAX_PLY][MAX_MOVES];
+
+    SearchShared *shared;
+    u32 thread_id;
+
+    // Private copy of the root position, searched in place
+    Board board;
+    u64 nodes;
+
+    // Drives the ordering noise of helper threads
+    u64 rng;
+
+    // Last completed iteration of this thread
+    SearchResult result;
+
+    // Local copy of shared->stop, refreshed when limits are polled.
+    // minimax then unwinds without storing anything, and the unfinished
+    // iteration is thrown away
+    bool stopped;
+
+    // Best root move of the iteration in progress
+    Move root_best_move;
+
+    // Quiet moves that caused a cutoff, two per ply, and a from/to score
+    // per side that grows with every cutoff a quiet move produces
+    Move killers[MAX_PLY][2];
+    i32 history[2][64][64];
+
+    u64 tt_probes;
+    u64 tt_hits;
+
+#ifdef SEARCH_STATS
+    SearchStats stats;
+#endif
+} SearchContext;
+
+// Counts every heap allocation the engine makes, so a caller can confirm a
+// search ran without allocating
+_Atomic u64 allocation_count = 0;
+
+void *engine_alloc(size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&allocation_count, 1, memory_order_relaxed);
+
+    // aligned_alloc wants the size to be a multiple of the alignment
+    size = (size + alignment - 1) / alignment * alignment;
+    void *memory = aligned_alloc(alignment, size);
+    if(!memory) {
+        fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+        exit(-1);
+    }
+    return memory;
+}
+
+// xorshift64*
+u64 random_u64(u64 *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline u64 read_be(const u8 *p, u32 bytes) {
+    u64 value = 0;
+    for(u32 i = 0; i < bytes; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static inline u64 read_le(const u8 *p, u32 bytes) {
+    u64 value = 0;
+    for(u32 i = bytes; i-- > 0;) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// Zobrist keys. The castling table holds the XOR of one key per right, so
+// the whole castling state hashes with a single lookup
+u64 zobrist_pieces[2][PIECE_TYPE_COUNT][64];
+u64 zobrist_castling[16];
+u64 zobrist_ep_file[8];
+u64 zobrist_side;
+
+void init_zobrist_keys(void) {
+    u64 state = 0x2D358DCCAA6C78A5ULL;
+    for(u32 color = 0; color < 2; color++) {
+        for(u32 type = 0; type < PIECE_TYPE_COUNT; type++) {
+            for(u32 square = 0; square < 64; square++) {
+                zobrist_pieces[color][type][square] = random_u64(&state);
+            }
+        }
+    }
+
+    u64 rights[4];
+    for(u32 i = 0; i < 4; i++) {
+        rights[i] = random_u64(&state);
+    }
+    for(u32 mask = 0; mask < 16; mask++) {
+        zobrist_castling[mask] = 0;
+        for(u32 i = 0; i < 4; i++) {
+            if(mask & (1 << i)) {
+                zobrist_castling[mask] ^= rights[i];
+            }
+        }
+    }
+
+    for(u32 file = 0; file < 8; file++) {
+        zobrist_ep_file[file] = random_u64(&state);
+    }
+    zobrist_side = random_u64(&state);
+}
+
+// Full recompute of the Zobrist key, used to validate the incremental one
+u64 compute_hash(const Board *b) {
+    u64 hash = 0;
+    u64 occupied = b->pieces_state;
+    while(occupied) {
+        u32 square = pop_lsb(&occupied);
+        const Piece *piece = &b->pieces[square];
+        hash ^= zobrist_pieces[piece->color][piece->type][square];
+    }
+
+    hash ^= zobrist_castling[b->castling_rights];
+    if(b->ep_square != NO_SQUARE) {
+        hash ^= zobrist_ep_file[SQUARE_X(b->ep_square)];
+    }
+    if(b->side_to_move == COLOR_BLACK) {
+        hash ^= zobrist_side;
+    }
+    return hash;
+}
+
+// Piece-square tables, expanded by the preprocessor from per-square integer
+// formulas. Each formula takes the square from white's side, black tables
+// mirror the rank and negate, so a sum over the board is white minus black
+#define PSQ_RANK(f, side, y) \
+    side(f, 0, y), side(f, 1, y), side(f, 2, y), side(f, 3, y), \
+    side(f, 4, y), side(f, 5, y), side(f, 6, y), side(f, 7, y)
+#define PSQ_TABLE(f, side) { \
+    PSQ_RANK(f, side, 0), PSQ_RANK(f, side, 1), PSQ_RANK(f, side, 2), PSQ_RANK(f, side, 3), \
+    PSQ_RANK(f, side, 4), PSQ_RANK(f, side, 5), PSQ_RANK(f, side, 6), PSQ_RANK(f, side, 7) }
+#define PSQ_WHITE(f, x, y) (f(x, y))
+#define PSQ_BLACK(f, x, y) (-f(x, 7 - (y)))
+
+// 4 on the edge files or ranks up to 7 in the centre
+#define CENTRE(c) ((c) < 4 ? 4 + (c) : 11 - (c))
+
+// Middlegame: pieces want the centre, the king wants to stay tucked away on
+// its back rank and rooks want the seventh rank
+#define KING_MG(x, y) (2000 + (7 - CENTRE(x)) * 8 - (y) * 15)
+#define PAWN_MG(x, y) (100 + CENTRE(x) * 8 + CENTRE(y) * 8)
+#define BISHOP_MG(x, y) (300 + CENTRE(x) * 6 + CENTRE(y) * 6)
+#define KNIGHT_MG(x, y) (300 + CENTRE(x) * 6 + CENTRE(y) * 6)
+#define ROOK_MG(x, y) (500 + CENTRE(x) * 2 + ((y) == 6 ? 20 : 0))
+#define QUEEN_MG(x, y) (900 + CENTRE(x) * 5 + CENTRE(y) * 5)
+
+// Endgame: the king joins in, pawns are worth more the closer they get to
+// promoting, knights lose some value and rooks and bishops gain some
+#define KING_EG(x, y) (2000 + (CENTRE(x) + CENTRE(y)) * 6)
+#define PAWN_EG(x, y) (140 + CENTRE(x) * 4 + (y) * 12)
+#define BISHOP_EG(x, y) (320 + CENTRE(x) * 4 + CENTRE(y) * 4)
+#define KNIGHT_EG(x, y) (290 + CENTRE(x) * 6 + CENTRE(y) * 6)
+#define ROOK_EG(x, y) (520 + ((y) == 6 ? 15 : 0))
+#define QUEEN_EG(x, y) (920 + CENTRE(x) * 6 + CENTRE(y) * 6)
+
+#define PSQ_PIECES(phase, side) { \
+    [KING] = PSQ_TABLE(KING_##phase, side), \
+    [PAWN] = PSQ_TABLE(PAWN_##phase, side), \
+    [BISHOP] = PSQ_TABLE(BISHOP_##phase, side), \
+    [KNIGHT] = PSQ_TABLE(KNIGHT_##phase, side), \
+    [ROOK] = PSQ_TABLE(ROOK_##phase, side), \
+    [QUEEN] = PSQ_TABLE(QUEEN_##phase, side) }
+
+static const i32 psq_mg[2][PIECE_TYPE_COUNT][64] = {
+    [COLOR_WHITE] = PSQ_PIECES(MG, PSQ_WHITE),
+    [COLOR_BLACK] = PSQ_PIECES(MG, PSQ_BLACK)
+};
+static const i32 psq_eg[2][PIECE_TYPE_COUNT][64] = {
+    [COLOR_WHITE] = PSQ_PIECES(EG, PSQ_WHITE),
+    [COLOR_BLACK] = PSQ_PIECES(EG, PSQ_BLACK)
+};
+
+// Game phase runs from PHASE_MAX with all minor and major pieces on the
+// board down to 0 with only kings and pawns left
+#define PHASE_MAX 24
+static const i32 phase_weight[PIECE_TYPE_COUNT] = {
+    [KING] = 0, [PAWN] = 0, [BISHOP] = 1, [KNIGHT] = 1, [ROOK] = 2, [QUEEN] = 4
+};
+
+// NNUE evaluation, used instead of the piece-square sums while a network
+// is loaded and enabled. One hidden layer of NNUE_HIDDEN neurons sits on
+// 768 inputs, one per color, piece type and square, seen from each side:
+// from black's side colors are swapped and the board is flipped. The
+// accumulator of a side is the first-layer bias plus the weight column of
+// every piece. make_move and unmake_move keep both up to date, so an
+// evaluation only runs the output layer, over the clipped accumulators of
+// the side to move and then the other side.
+//
+// Network files are little-endian: the magic "CENN", a u32 version (1),
+// a u32 hidden size (NNUE_HIDDEN), i16 feature weights by input, i16
+// feature biases, i8 output weights and an i32 output bias. Input index is
+// ((color != side) * 6 + PieceType) * 64 + square, square flipped for black
+#define NNUE_INPUTS (2 * PIECE_TYPE_COUNT * 64)
+#define NNUE_VERSION 1
+
+// Accumulators are clipped to [0, NNUE_QA] and output weights are in units
+// of 1 / NNUE_QB. NNUE_SCALE turns the output into centipawns, and scores
+// are capped well inside the mate range
+#define NNUE_QA 127
+#define NNUE_QB 64
+#define NNUE_SCALE 400
+#define NNUE_MAX_SCORE 10000
+
+typedef struct {
+    // One allocation holding every weight, feature_weights at its start
+    void *memory;
+    i16 *feature_weights;
+    i16 *feature_bias;
+    i8 *output_weights;
+    i32 output_bias;
+
+    bool loaded;
+    bool enabled;
+
+    // Kernels picked for the CPU at startup
+    const char *kernel;
+    void (*add)(i16 *accumulator, const i16 *weights);
+    void (*sub)(i16 *accumulator, const i16 *weights);
+    i32 (*output)(const i16 *us, const i16 *them, const i8 *weights);
+} Nnue;
+
+Nnue nnue = {0};
+
+static void nnue_add_scalar(i16 *accumulator, const i16 *weights) {
+    for(u32 i = 0; i < NNUE_HIDDEN; i++) {
+        accumulator[i] += weights[i];
+    }
+}
+
+static void nnue_sub_scalar(i16 *accumulator, const i16 *weights) {
+    for(u32 i = 0; i < NNUE_HIDDEN; i++) {
+        accumulator[i] -= weights[i];
+    }
+}
+
+static i32 nnue_output_scalar(const i16 *us, const i16 *them, const i8 *weights) {
+    i32 sum = 0;
+    for(u32 i = 0; i < NNUE_HIDDEN; i++) {
+        sum += MIN(MAX(us[i], 0), NNUE_QA) * weights[i];
+        sum += MIN(MAX(them[i], 0), NNUE_QA) * weights[NNUE_HIDDEN + i];
+    }
+    return sum;
+}
+
+// SIMD kernels are compiled for their instruction set only and picked at
+// runtime, so one binary runs everywhere. The output layer packs the
+// clipped accumulators to bytes and multiplies them with the i8 weights
+// in pairs, which cannot saturate: 2 * 127 * 128 fits in an i16
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void nnue_add_avx2(i16 *accumulator, const i16 *weights) {
+    for(u32 i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i *a = (__m256i *)(accumulator + i);
+        __m256i w = _mm256_loadu_si256((const __m256i *)(weights + i));
+        _mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), w));
+    }
+}
+
+__attribute__((target("avx2")))
+static void nnue_sub_avx2(i16 *accumulator, const i16 *weights) {
+    for(u32 i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i *a = (__m256i *)(accumulator + i);
+        __m256i w = _mm256_loadu_si256((const __m256i *)(weights + i));
+        _mm256_storeu_si256(a, _mm256_sub_epi16(_mm256_loadu_si256(a), w));
+    }
+}
+
+__attribute__((target("avx2")))
+static i32 nnue_output_avx2(const i16 *us, const i16 *them, const i8 *weights) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i limit = _mm256_set1_epi16(NNUE_QA);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const i16 *halves[2] = {us, them};
+    __m256i sum = zero;
+    for(u32 half = 0; half < 2; half++) {
+        const i16 *accumulator = halves[half];
+        const i8 *w = weights + half * NNUE_HIDDEN;
+        for(u32 i = 0; i < NNUE_HIDDEN; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(accumulator + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(accumulator + i + 16));
+            a = _mm256_min_epi16(_mm256_max_epi16(a, zero), limit);
+            b = _mm256_min_epi16(_mm256_max_epi16(b, zero), limit);
+            // Packing works per 128-bit lane, the permute restores the order
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+            __m256i products = _mm256_maddubs_epi16(packed, _mm256_loadu_si256((const __m256i *)(w + i)));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(products, ones));
+        }
+    }
+    __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0x4E));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0xB1));
+    return _mm_cvtsi128_si32(total);
+}
+
+__attribute__((target("sse4.1")))
+static void nnue_add_sse41(i16 *accumulator, const i16 *weights) {
+    for(u32 i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i *a = (__m128i *)(accumulator + i);
+        __m128i w = _mm_loadu_si128((const __m128i *)(weights + i));
+        _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), w));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void nnue_sub_sse41(i16 *accumulator, const i16 *weights) {
+    for(u32 i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i *a = (__m128i *)(accumulator + i);
+        __m128i w = _mm_loadu_si128((const __m128i *)(weights + i));
+        _mm_storeu_si128(a, _mm_sub_epi16(_mm_loadu_si128(a), w));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static i32 nnue_output_sse41(const i16 *us, const i16 *them, const i8 *weights) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi16(NNUE_QA);
+    const __m128i ones = _mm_set1_epi16(1);
+    const i16 *halves[2] = {us, them};
+    __m128i sum = zero;
+    for(u32 half = 0; half < 2; half++) {
+        const i16 *accumulator = halves[half];
+        const i8 *w = weights + half * NNUE_HIDDEN;
+        for(u32 i = 0; i < NNUE_HIDDEN; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(accumulator + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(accumulator + i + 8));
+            a = _mm_min_epi16(_mm_max_epi16(a, zero), limit);
+            b = _mm_min_epi16(_mm_max_epi16(b, zero), limit);
+            __m128i products = _mm_maddubs_epi16(_mm_packus_epi16(a, b), _mm_loadu_si128((const __m128i *)(w + i)));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(products, ones));
+        }
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+// Picks the widest kernels the CPU supports
+void init_nnue_kernels(void) {
+    nnue.kernel = "scalar";
+    nnue.add = nnue_add_scalar;
+    nnue.sub = nnue_sub_scalar;
+    nnue.output = nnue_output_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        nnue.kernel = "avx2";
+        nnue.add = nnue_add_avx2;
+        nnue.sub = nnue_sub_avx2;
+        nnue.output = nnue_output_avx2;
+    } else if(__builtin_cpu_supports("sse4.1")) {
+        nnue.kernel = "sse4.1";
+        nnue.add = nnue_add_sse41;
+        nnue.sub = nnue_sub_sse41;
+        nnue.output = nnue_output_sse41;
+    }
+#endif
+}
+
+static inline const i16 *nnue_column(u32 side, PieceType type, u32 color, u32 square) {
+    u32 input = ((color != side) * PIECE_TYPE_COUNT + type) * 64 + (side == COLOR_WHITE ? square : square ^ 56);
+    return nnue.feature_weights + input * NNUE_HIDDEN;
+}
+
+// Accumulator update for a piece that lands (sign 1) or leaves (sign -1)
+static inline void nnue_toggle(u32 square, PieceType type, u32 color, i32 sign, Board *b) {
+    for(u32 side = 0; side < 2; side++) {
+        if(sign > 0) {
+            nnue.add(b->accumulator[side], nnue_column(side, type, color, square));
+        } else {
+            nnue.sub(b->accumulator[side], nnue_column(side, type, color, square));
+        }
+    }
+}
+
+// Rebuilds both accumulators from the pieces on the board
+void nnue_refresh(Board *b) {
+    for(u32 side = 0; side < 2; side++) {
+        memcpy(b->accumulator[side], nnue.feature_bias, sizeof(b->accumulator[side]));
+    }
+    u64 occupied = b->pieces_state;
+    while(occupied) {
+        u32 square = pop_lsb(&occupied);
+        nnue_toggle(square, b->pieces[square].type, b->pieces[square].color, 1, b);
+    }
+}
+
+// Score for the side to move
+static inline i32 nnue_evaluate(const Board *b) {
+    u32 us = b->side_to_move;
+    i64 sum = nnue.output(b->accumulator[us], b->accumulator[us ^ 1], nnue.output_weights);
+    i64 score = (sum + nnue.output_bias) * NNUE_SCALE / (NNUE_QA * NNUE_QB);
+    return (i32)MIN(MAX(score, -NNUE_MAX_SCORE), NNUE_MAX_SCORE);
+}
+
+void nnue_free(void) {
+    free(nnue.memory);
+    nnue.memory = NULL;
+    nnue.loaded = false;
+    nnue.enabled = false;
+}
+
+// Loads and enables the network at path. On failure the previous network,
+// if any, stays in use
+bool nnue_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if(!file) {
+        return false;
+    }
+
+    size_t weight_count = (size_t)NNUE_INPUTS * NNUE_HIDDEN + NNUE_HIDDEN;
+    size_t size = 12 + 2 * weight_count + 2 * NNUE_HIDDEN + 4;
+    u8 *data = engine_alloc(64, size + 1);
+    // One byte more than expected, to catch longer files
+    bool ok = fread(data, 1, size + 1, file) == size && memcmp(data, "CENN", 4) == 0
+        && read_le(data + 4, 4) == NNUE_VERSION && read_le(data + 8, 4) == NNUE_HIDDEN;
+    fclose(file);
+    if(!ok) {
+        free(data);
+        return false;
+    }
+
+    // Copied out of the file data so the weights are aligned and in host
+    // byte order
+    nnue_free();
+    nnue.memory = engine_alloc(64, 2 * weight_count + 2 * NNUE_HIDDEN);
+    nnue.feature_weights = nnue.memory;
+    nnue.feature_bias = nnue.feature_weights + (size_t)NNUE_INPUTS * NNUE_HIDDEN;
+    nnue.output_weights = (i8 *)(nnue.feature_bias + NNUE_HIDDEN);
+    const u8 *p = data + 12;
+    for(size_t i = 0; i < weight_count; i++, p += 2) {
+        nnue.feature_weights[i] = (i16)read_le(p, 2);
+    }
+    memcpy(nnue.output_weights, p, 2 * NNUE_HIDDEN);
+    p += 2 * NNUE_HIDDEN;
+    nnue.output_bias = (i32)read_le(p, 4);
+    free(data);
+
+    nnue.loaded = true;
+    nnue.enabled = true;
+    return true;
+}
 
-u32 minimax_count = 0;
-Move best_move;
+static inline void psq_toggle(u32 square, PieceType type, u32 color, i32 sign, Board *b) {
+    b->psq_mg += sign * psq_mg[color][type][square];
+    b->psq_eg += sign * psq_eg[color][type][square];
+    b->phase += sign * phase_weight[type];
+    if(nnue.enabled) {
+        nnue_toggle(square, type, color, sign, b);
+    }
+}
 
 Piece *get_piece(u32 x, u32 y, Board *b) {
     u32 index = x + y * 8;
     if(index >= 64) {
         return NULL;
     }
-    if(b->pieces_state & (1L << index)) {
+    if(b->pieces_state & SQUARE_BIT(index)) {
         return &b->pieces[index];
     }
 
     return NULL;
 }
 
+void remove_piece(u32 x, u32 y, Board *b) {
+    u32 square = SQUARE(x, y);
+    u64 bit = SQUARE_BIT(square);
+    if(!(b->pieces_state & bit)) {
+        return;
+    }
+
+    const Piece *piece = &b->pieces[square];
+    b->piece_bb[piece->type] &= ~bit;
+    b->color_bb[piece->color] &= ~bit;
+    b->pieces_state &= ~bit;
+    b->hash ^= zobrist_pieces[piece->color][piece->type][square];
+    psq_toggle(square, piece->type, piece->color, -1, b);
+}
+
 void set_piece(u32 x, u32 y, const Piece *piece, Board *b) {
-    b->pieces[x + y * 8] = *piece;
-    b->pieces_state |= (1L << (x + y * 8));
+    u32 square = SQUARE(x, y);
+    u64 bit = SQUARE_BIT(square);
+
+    // Replacing a piece has to clear it from its own bitboards first
+    remove_piece(x, y, b);
+
+    b->pieces[square] = *piece;
+    b->piece_bb[piece->type] |= bit;
+    b->color_bb[piece->color] |= bit;
+    b->pieces_state |= bit;
+    b->hash ^= zobrist_pieces[piece->color][piece->type][square];
+    psq_toggle(square, piece->type, piece->color, 1, b);
 
     if(piece->type == KING) {
-        if(piece->color == COLOR_WHITE) {
-            b->white_king_pos.x = x;
-            b->white_king_pos.y = y;
-        } else {
-            b->black_king_pos.x = x;
-            b->black_king_pos.y = y;
-        }
+        b->king_square[piece->color] = square;
     }
 }
 
@@ -113,83 +777,64 @@ void setup_board(Board *b) {
     for(u32 i = 0; i < 8; i++) {
         set_piece(i, 6, &(Piece){.type = PAWN, .color = COLOR_BLACK}, b);
     }
+
+    b->castling_rights = CASTLE_ALL;
+    b->ep_square = NO_SQUARE;
+    b->side_to_move = COLOR_WHITE;
+    b->fullmove_number = 1;
+    b->hash ^= zobrist_castling[CASTLE_ALL];
+    if(nnue.enabled) {
+        nnue_refresh(b);
+    }
 }
 
-void remove_piece(u32 x, u32 y, Board *b) {
-    b->pieces_state &= ~(1L << (x + y * 8));
+// Leaf evaluation: the running sums blended by game phase. Promotions can
+// push the phase past PHASE_MAX, which still counts as a full middlegame.
+// With a network enabled, its score turned to white's side instead
+static inline i32 evaluate_board(const Board *b) {
+    if(nnue.enabled) {
+        i32 score = nnue_evaluate(b);
+        return b->side_to_move == COLOR_WHITE ? score : -score;
+    }
+    i32 phase = MIN(b->phase, PHASE_MAX);
+    return (b->psq_mg * phase + b->psq_eg * (PHASE_MAX - phase)) / PHASE_MAX;
 }
 
-void move_piece(u32 x_from, u32 y_from, u32 x_to, u32 y_to, Board *b) {
-    Piece *piece = get_piece(x_from, y_from, b);
-    if(!piece) {
-        return;
+#ifdef DEBUG_CHECKS
+void validate_board(const Board *b, const char *where) {
+    if(b->hash != compute_hash(b)) {
+        fprintf(stderr, "Zobrist key mismatch after %s\n", where);
+        abort();
     }
 
-    remove_piece(x_from, y_from, b);
-    set_piece(x_to, y_to, piece, b);
-}
-
-i32 evaluate_board(Board *b) {
-    i32 white = 0;
-    i32 black = 0;
-
-    for(i32 x = 0; x < 8; x++) {
-        for(i32 y = 0; y < 8; y++) {
-            Piece *piece = get_piece(x, y, b);
-            if(piece) {
-                i32 value = 0;
-                switch(piece->type) {
-                    case KING:
-                    {
-                        value = 2000;
-                        break;
-                    }
-                    case PAWN:
-                    {
-                        value = 100;
-                        value += (i32)(8 - fabsf(3.5f - x)) * 8;
-                        value += (i32)(8 - fabsf(3.5f - y)) * 8;
-                        break;
-                    }
-                    case BISHOP:
-                    case KNIGHT:
-                    {
-                        value = 300;
-                        value += (i32)(8 - fabsf(3.5f - x)) * 6;
-                        value += (i32)(8 - fabsf(3.5f - y)) * 6;
-                        break;
-                    }
-                    case ROOK:
-                    {
-                        value = 500;
-                        break;
-                    }
-                    case QUEEN:
-                    {
-                        value = 900;
-                        value += (i32)(8 - fabsf(3.5f - x)) * 5;
-                        value += (i32)(8 - fabsf(3.5f - y)) * 5;
-                        break;
-                    }
-                    default:
-                    {
-                        value = 0;
-                        break;
-                    }
-                }
+    // Full rescan of the board for the running evaluation terms
+    i32 mg = 0;
+    i32 eg = 0;
+    i32 phase = 0;
+    u64 occupied = b->pieces_state;
+    while(occupied) {
+        u32 square = pop_lsb(&occupied);
+        const Piece *piece = &b->pieces[square];
+        mg += psq_mg[piece->color][piece->type][square];
+        eg += psq_eg[piece->color][piece->type][square];
+        phase += phase_weight[piece->type];
+    }
+    if(b->psq_mg != mg || b->psq_eg != eg || b->phase != phase) {
+        fprintf(stderr, "Evaluation mismatch after %s: %d/%d/%d, full scan %d/%d/%d\n",
+            where, b->psq_mg, b->psq_eg, b->phase, mg, eg, phase);
+        abort();
+    }
 
-                if(piece->color == COLOR_WHITE) {
-                    white += value;
-                } else {
-                    black += value;
-                }
-            }
+    if(nnue.enabled) {
+        Board refreshed = *b;
+        nnue_refresh(&refreshed);
+        if(memcmp(refreshed.accumulator, b->accumulator, sizeof(b->accumulator)) != 0) {
+            fprintf(stderr, "NNUE accumulator mismatch after %s\n", where);
+            abort();
         }
     }
-
-    i32 piece_eval = (white - black);
-    return piece_eval;
 }
+#endif
 
 char piece_to_char(const Piece *piece) {
     switch(piece->type) {
@@ -260,7 +905,7 @@ void print_board(const Board *b) {
     for(i32 i = 56; i >= 0; i -= 8) {
         printf("|");
         for(u32 j = i; j < i + 8; j++) {
-            if(b->pieces_state & (1L << j)) {
+            if(b->pieces_state & SQUARE_BIT(j)) {
                 printf("%c|", piece_to_char(&b->pieces[j]));
             } else {
                 printf(" |");
@@ -271,919 +916,4922 @@ void print_board(const Board *b) {
     printf("-----------------\n");
 }
 
-void generate_moves_for_piece(u32 x, u32 y, u32 color_to_move, Board *b, Move *moves, u32 *move_count) {
-    const Piece *piece = get_piece(x, y, b);
-    if(!piece) {
-        *move_count = 0;
-        return;
+// Long algebraic notation as used by UCI, e.g. e2e4 or e7e8q. out needs
+// room for 6 characters
+void move_to_string(Move move, char *out) {
+    static const char promotion_chars[PIECE_TYPE_COUNT] = {
+        [BISHOP] = 'b', [KNIGHT] = 'n', [ROOK] = 'r', [QUEEN] = 'q'
+    };
+
+    u32 from = MOVE_FROM(move);
+    u32 to = MOVE_TO(move);
+    *out++ = 'a' + SQUARE_X(from);
+    *out++ = '1' + SQUARE_Y(from);
+    *out++ = 'a' + SQUARE_X(to);
+    *out++ = '1' + SQUARE_Y(to);
+    if(MOVE_IS_PROMOTION(move)) {
+        *out++ = promotion_chars[MOVE_PROMOTION_TYPE(move)];
     }
-    if(piece->color != color_to_move) {
-        *move_count = 0;
-        return;
+    *out = '\0';
+}
+
+// Leaper attack tables, filled by init_attack_tables
+u64 knight_attack_table[64];
+u64 king_attack_table[64];
+u64 pawn_attack_table[2][64];
+
+static inline u64 knight_attacks(u32 square) {
+    return knight_attack_table[square];
+}
+
+static inline u64 king_attacks(u32 square) {
+    return king_attack_table[square];
+}
+
+static inline u64 pawn_attacks(u32 square, u32 color) {
+    return pawn_attack_table[color][square];
+}
+
+void init_leaper_tables(void) {
+    for(u32 square = 0; square < 64; square++) {
+        u64 bit = SQUARE_BIT(square);
+
+        u64 one_file = ((bit >> 1) & ~FILE_H) | ((bit << 1) & ~FILE_A);
+        u64 two_files = ((bit >> 2) & ~(FILE_G | FILE_H)) | ((bit << 2) & ~(FILE_A | FILE_B));
+        knight_attack_table[square] = (one_file << 16) | (one_file >> 16) | (two_files << 8) | (two_files >> 8);
+
+        u64 row = bit | one_file;
+        king_attack_table[square] = (row | (row << 8) | (row >> 8)) & ~bit;
+
+        pawn_attack_table[COLOR_WHITE][square] = one_file << 8;
+        pawn_attack_table[COLOR_BLACK][square] = one_file >> 8;
     }
+}
 
-    u32 i = 0;
-    Move move;
-    move.from.x = x;
-    move.from.y = y;
-    move.to.x = x;
-    move.to.y = y;
-    move.capture = false;
-    switch(piece->type) {
-        case KING:
-        {
-            // Left
-            if(x > 0 && !(get_piece(x - 1, y, b) && get_piece(x - 1, y, b)->color == color_to_move)) {
-                move.to.x = x - 1;
-                if(get_piece(x - 1, y, b) && get_piece(x - 1, y, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
+// Walks a single ray, stopping on (and including) the first occupied square.
+// Only used to build the slider tables at startup
+u64 ray_attacks(u32 square, u64 occupied, i32 dx, i32 dy) {
+    u64 attacks = 0;
+    i32 x = SQUARE_X(square) + dx;
+    i32 y = SQUARE_Y(square) + dy;
+    while(x >= 0 && x < 8 && y >= 0 && y < 8) {
+        u64 bit = SQUARE_BIT(SQUARE(x, y));
+        attacks |= bit;
+        if(occupied & bit) {
+            break;
+        }
+        x += dx;
+        y += dy;
+    }
+    return attacks;
+}
 
-            // Top left
-            if(x > 0 && y < 7 && !(get_piece(x - 1, y + 1, b) && get_piece(x - 1, y + 1, b)->color == color_to_move)) {
-                move.to.x = x - 1;
-                move.to.y = y + 1;
-                if(get_piece(x - 1, y + 1, b) && get_piece(x - 1, y + 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
+static const i32 bishop_directions[4][2] = {{-1, 1}, {1, 1}, {1, -1}, {-1, -1}};
+static const i32 rook_directions[4][2] = {{-1, 0}, {0, 1}, {1, 0}, {0, -1}};
 
-            // Top
-            if(y < 7 && !(get_piece(x, y + 1, b) && get_piece(x, y + 1, b)->color == color_to_move)) {
-                move.to.y = y + 1;
-                if(get_piece(x, y + 1, b) && get_piece(x, y + 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
+u64 slider_rays(u32 square, u64 occupied, const i32 directions[4][2]) {
+    u64 attacks = 0;
+    for(u32 i = 0; i < 4; i++) {
+        attacks |= ray_attacks(square, occupied, directions[i][0], directions[i][1]);
+    }
+    return attacks;
+}
 
-            // Top right
-            if(x < 7 && y < 7 && !(get_piece(x + 1, y + 1, b) && get_piece(x + 1, y + 1, b)->color == color_to_move)) {
-                move.to.x = x + 1;
-                move.to.y = y + 1;
-                if(get_piece(x + 1, y + 1, b) && get_piece(x + 1, y + 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
+// Slider attacks come from one table lookup per square, indexed either by
+// magic multiplication or, when built with USE_PEXT, by BMI2 PEXT
+typedef struct {
+    u64 mask;
+    u64 magic;
+    u64 *attacks;
+    u32 shift;
+} Magic;
 
-            // Right
-            if(x < 7 && !(get_piece(x + 1, y, b) && get_piece(x + 1, y, b)->color == color_to_move)) {
-                move.to.x = x + 1;
-                if(get_piece(x + 1, y, b) && get_piece(x + 1, y, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
+Magic bishop_magics[64];
+Magic rook_magics[64];
+u64 bishop_table[0x1480];
+u64 rook_table[0x19000];
 
-            // Bottom right
-            if(x < 7 && y > 0 && !(get_piece(x + 1, y - 1, b) && get_piece(x + 1, y - 1, b)->color == color_to_move)) {
-                move.to.x = x + 1;
-                move.to.y = y - 1;
-                if(get_piece(x + 1, y - 1, b) && get_piece(x + 1, y - 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
+static inline u32 magic_index(const Magic *m, u64 occupied) {
+#ifdef USE_PEXT
+    return (u32)_pext_u64(occupied, m->mask);
+#else
+    return (u32)(((occupied & m->mask) * m->magic) >> m->shift);
+#endif
+}
+
+static inline u64 bishop_attacks(u32 square, u64 occupied) {
+    const Magic *m = &bishop_magics[square];
+    return m->attacks[magic_index(m, occupied)];
+}
+
+static inline u64 rook_attacks(u32 square, u64 occupied) {
+    const Magic *m = &rook_magics[square];
+    return m->attacks[magic_index(m, occupied)];
+}
+
+// Squares strictly between two aligned squares, and the full line through
+// them. Both are empty when the squares don't share a rank, file or diagonal
+u64 between_table[64][64];
+u64 line_table[64][64];
+
+void init_line_tables(void) {
+    for(u32 from = 0; from < 64; from++) {
+        for(u32 to = 0; to < 64; to++) {
+            u64 to_bit = SQUARE_BIT(to);
+            if(from == to) {
+                continue;
             }
 
-            // Bottom
-            if(y > 0 && !(get_piece(x, y - 1, b) && get_piece(x, y - 1, b)->color == color_to_move)) {
-                move.to.y = y - 1;
-                if(get_piece(x, y - 1, b) && get_piece(x, y - 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
+            if(slider_rays(from, 0, bishop_directions) & to_bit) {
+                between_table[from][to] = bishop_attacks(from, to_bit) & bishop_attacks(to, SQUARE_BIT(from));
+                line_table[from][to] = (slider_rays(from, 0, bishop_directions) & slider_rays(to, 0, bishop_directions))
+                    | SQUARE_BIT(from) | to_bit;
+            } else if(slider_rays(from, 0, rook_directions) & to_bit) {
+                between_table[from][to] = rook_attacks(from, to_bit) & rook_attacks(to, SQUARE_BIT(from));
+                line_table[from][to] = (slider_rays(from, 0, rook_directions) & slider_rays(to, 0, rook_directions))
+                    | SQUARE_BIT(from) | to_bit;
             }
+        }
+    }
+}
 
-            // Bottom left
-            if(x > 0 && y > 0 && !(get_piece(x - 1, y - 1, b) && get_piece(x - 1, y - 1, b)->color == color_to_move)) {
-                move.to.x = x - 1;
-                move.to.y = y - 1;
-                if(get_piece(x - 1, y - 1, b) && get_piece(x - 1, y - 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
+// Seeded so that the magics found are the same on every run
+u64 magic_rng_state = 0x9E3779B97F4A7C15ULL;
+
+void init_slider_table(Magic *magics, u64 *table, const i32 directions[4][2]) {
+    u64 occupancies[4096];
+    u64 references[4096];
+#ifndef USE_PEXT
+    u32 epoch[4096] = {0};
+    u32 current_epoch = 0;
+#endif
+    u64 *next_attacks = table;
+
+    for(u32 square = 0; square < 64; square++) {
+        Magic *m = &magics[square];
+
+        // Edge squares never block anything, so leave them out of the mask
+        u64 edges = ((RANK_1 | RANK_8) & ~(RANK_1 << (SQUARE_Y(square) * 8)))
+            | ((FILE_A | FILE_H) & ~(FILE_A << SQUARE_X(square)));
+        m->mask = slider_rays(square, 0, directions) & ~edges;
+        m->shift = 64 - POPCOUNT(m->mask);
+        m->attacks = next_attacks;
+
+        // Carry-Rippler enumeration of every subset of the mask
+        u32 size = 0;
+        u64 subset = 0;
+        do {
+            occupancies[size] = subset;
+            references[size] = slider_rays(square, subset, directions);
+            size++;
+            subset = (subset - m->mask) & m->mask;
+        } while(subset);
+        next_attacks += size;
+
+#ifdef USE_PEXT
+        m->magic = 0;
+        for(u32 i = 0; i < size; i++) {
+            m->attacks[_pext_u64(occupancies[i], m->mask)] = references[i];
+        }
+#else
+        // Try sparse random candidates until one maps every subset without
+        // a destructive collision
+        u32 i = 0;
+        while(i < size) {
+            do {
+                m->magic = random_u64(&magic_rng_state) & random_u64(&magic_rng_state) & random_u64(&magic_rng_state);
+            } while(POPCOUNT((m->mask * m->magic) >> 56) < 6);
+
+            current_epoch++;
+            for(i = 0; i < size; i++) {
+                u32 index = magic_index(m, occupancies[i]);
+                if(epoch[index] < current_epoch) {
+                    epoch[index] = current_epoch;
+                    m->attacks[index] = references[i];
+                } else if(m->attacks[index] != references[i]) {
+                    break;
                 }
-                moves[i] = move;
-                i++;
             }
-            break;
         }
-        case PAWN:
-        {
-            if(color_to_move == COLOR_WHITE) {
-                // One square
-                if(y < 7 && !get_piece(x, y + 1, b)) {
-                    move.to.y = y + 1;
-                    moves[i] = move;
-                    i++;
-                }
-                // Two squares
-                if(y == 1
-                    && !get_piece(x, 2, b)
-                    && !get_piece(x, 3, b)) {
-                    move.to.y = 3;
-                    moves[i] = move;
-                    i++;
-                }
-                // Diagonal capture
-                if(y < 7
-                    && x < 7
-                    && get_piece(x + 1, y + 1, b)
-                    && get_piece(x + 1, y + 1, b)->color != color_to_move) {
-                    move.to.x = x + 1;
-                    move.to.y = y + 1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                }
-                if(y < 7
-                    && x > 0
-                    && get_piece(x - 1, y + 1, b)
-                    && get_piece(x - 1, y + 1, b)->color != color_to_move) {
-                    move.to.x = x - 1;
-                    move.to.y = y + 1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                }
-                move.capture = false;
-            } else {
-                // One square
-                if(y > 0 && !get_piece(x, y - 1, b)) {
-                    move.to.y = y - 1;
-                    moves[i] = move;
-                    i++;
-                }
-                // Two squares
-                if(y == 6
-                    && !get_piece(x, 5, b)
-                    && !get_piece(x, 4, b)) {
-                    move.to.y = 4;
-                    moves[i] = move;
-                    i++;
-                }
-                // Diagonal capture
-                if(y > 0
-                    && x < 7
-                    && get_piece(x + 1, y - 1, b)
-                    && get_piece(x + 1, y - 1, b)->color != color_to_move) {
-                    move.to.x = x + 1;
-                    move.to.y = y - 1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                }
-                if(y > 0
-                    && x > 0
-                    && get_piece(x - 1, y - 1, b)
-                    && get_piece(x - 1, y - 1, b)->color != color_to_move) {
-                    move.to.x = x - 1;
-                    move.to.y = y - 1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                }
-                move.capture = false;
-            }
-            break;
+#endif
+    }
+}
+
+void init_attack_tables(void) {
+    init_leaper_tables();
+    init_slider_table(bishop_magics, bishop_table, bishop_directions);
+    init_slider_table(rook_magics, rook_table, rook_directions);
+    init_line_tables();
+}
+
+// Rights that survive a move touching each square, i.e. moving a king or
+// rook or capturing on a rook's home square clears the matching rights
+static const u8 castling_rights_mask[64] = {
+    13, 15, 15, 15, 12, 15, 15, 14,
+    15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15,
+     7, 15, 15, 15,  3, 15, 15, 11
+};
+
+static inline void toggle_piece(u32 square, PieceType type, u32 color, Board *b) {
+    u64 bit = SQUARE_BIT(square);
+    b->piece_bb[type] ^= bit;
+    b->color_bb[color] ^= bit;
+    b->pieces_state ^= bit;
+}
+
+// toggle_piece plus the matching Zobrist and evaluation updates. sign is 1
+// when the piece lands and -1 when it leaves. unmake_move restores the saved
+// key and sums instead, so it uses the plain version
+static inline void toggle_piece_incremental(u32 square, PieceType type, u32 color, i32 sign, Board *b) {
+    toggle_piece(square, type, color, b);
+    b->hash ^= zobrist_pieces[color][type][square];
+    psq_toggle(square, type, color, sign, b);
+}
+
+// toggle_piece for unmake_move. The NNUE accumulators are too large to save
+// in Undo, so they are updated backwards. sign is as in make_move
+static inline void toggle_piece_undo(u32 square, PieceType type, u32 color, i32 sign, Board *b) {
+    toggle_piece(square, type, color, b);
+    if(nnue.enabled) {
+        nnue_toggle(square, type, color, -sign, b);
+    }
+}
+
+// Rook squares for a castling move, given the king's destination
+static inline void castling_rook_squares(u32 king_to, u32 flags, u32 *rook_from, u32 *rook_to) {
+    if(flags == FLAG_KING_CASTLE) {
+        *rook_from = king_to + 1;
+        *rook_to = king_to - 1;
+    } else {
+        *rook_from = king_to - 2;
+        *rook_to = king_to + 1;
+    }
+}
+
+void make_move(Move move, Undo *undo, Board *b) {
+    u32 from = MOVE_FROM(move);
+    u32 to = MOVE_TO(move);
+    u32 flags = MOVE_FLAGS(move);
+    Piece piece = b->pieces[from];
+
+    undo->king_square[COLOR_WHITE] = b->king_square[COLOR_WHITE];
+    undo->king_square[COLOR_BLACK] = b->king_square[COLOR_BLACK];
+    undo->castling_rights = b->castling_rights;
+    undo->ep_square = b->ep_square;
+    undo->halfmove_clock = b->halfmove_clock;
+    undo->hash = b->hash;
+    undo->psq_mg = b->psq_mg;
+    undo->psq_eg = b->psq_eg;
+    undo->phase = b->phase;
+
+    if(b->ep_square != NO_SQUARE) {
+        b->hash ^= zobrist_ep_file[SQUARE_X(b->ep_square)];
+        b->ep_square = NO_SQUARE;
+    }
+
+    if(flags & FLAG_CAPTURE) {
+        // The en passant victim sits behind the destination square
+        u32 captured_square = flags == FLAG_EN_PASSANT ? to ^ 8 : to;
+        undo->captured = b->pieces[captured_square];
+        toggle_piece_incremental(captured_square, undo->captured.type, undo->captured.color, -1, b);
+    }
+
+    toggle_piece_incremental(from, piece.type, piece.color, -1, b);
+    if(flags & FLAG_PROMOTION) {
+        piece.type = MOVE_PROMOTION_TYPE(move);
+    }
+    toggle_piece_incremental(to, piece.type, piece.color, 1, b);
+    b->pieces[to] = piece;
+
+    if(flags == FLAG_KING_CASTLE || flags == FLAG_QUEEN_CASTLE) {
+        u32 rook_from, rook_to;
+        castling_rook_squares(to, flags, &rook_from, &rook_to);
+        toggle_piece_incremental(rook_from, ROOK, piece.color, -1, b);
+        toggle_piece_incremental(rook_to, ROOK, piece.color, 1, b);
+        b->pieces[rook_to] = b->pieces[rook_from];
+    } else if(flags == FLAG_DOUBLE_PUSH) {
+        u32 ep_square = (from + to) / 2;
+        if(pawn_attacks(ep_square, piece.color) & b->piece_bb[PAWN] & b->color_bb[piece.color ^ 1]) {
+            b->ep_square = ep_square;
+            b->hash ^= zobrist_ep_file[SQUARE_X(ep_square)];
         }
-        case BISHOP:
-        {
-            // Top left
-            u32 x1 = x;
-            u32 y1 = y;
-            move.capture = false;
-            while(x1 > 0 && y1 < 7) {
-                x1--;
-                y1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
-            }
+    }
 
-            // Top right
-            x1 = x;
-            y1 = y;
-            move.capture = false;
-            while(x1 < 7 && y1 < 7) {
-                x1++;
-                y1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
+    if(piece.type == KING) {
+        b->king_square[piece.color] = to;
+    }
+
+    if(piece.type == PAWN || (flags & (FLAG_CAPTURE | FLAG_PROMOTION))) {
+        b->halfmove_clock = 0;
+    } else {
+        b->halfmove_clock++;
+    }
+    if(piece.color == COLOR_BLACK) {
+        b->fullmove_number++;
+    }
+
+    b->hash ^= zobrist_castling[b->castling_rights];
+    b->castling_rights &= castling_rights_mask[from] & castling_rights_mask[to];
+    b->hash ^= zobrist_castling[b->castling_rights];
+
+    b->side_to_move ^= 1;
+    b->hash ^= zobrist_side;
+
+#ifdef DEBUG_CHECKS
+    validate_board(b, "make_move");
+#endif
+}
+
+void unmake_move(Move move, const Undo *undo, Board *b) {
+    u32 from = MOVE_FROM(move);
+    u32 to = MOVE_TO(move);
+    u32 flags = MOVE_FLAGS(move);
+    Piece piece = b->pieces[to];
+
+    toggle_piece_undo(to, piece.type, piece.color, 1, b);
+    if(flags & FLAG_PROMOTION) {
+        piece.type = PAWN;
+    }
+    toggle_piece_undo(from, piece.type, piece.color, -1, b);
+    b->pieces[from] = piece;
+
+    if(flags == FLAG_KING_CASTLE || flags == FLAG_QUEEN_CASTLE) {
+        u32 rook_from, rook_to;
+        castling_rook_squares(to, flags, &rook_from, &rook_to);
+        toggle_piece_undo(rook_to, ROOK, piece.color, 1, b);
+        toggle_piece_undo(rook_from, ROOK, piece.color, -1, b);
+        b->pieces[rook_from] = b->pieces[rook_to];
+    }
+
+    if(flags & FLAG_CAPTURE) {
+        u32 captured_square = flags == FLAG_EN_PASSANT ? to ^ 8 : to;
+        toggle_piece_undo(captured_square, undo->captured.type, undo->captured.color, -1, b);
+        b->pieces[captured_square] = undo->captured;
+    }
+
+    b->king_square[COLOR_WHITE] = undo->king_square[COLOR_WHITE];
+    b->king_square[COLOR_BLACK] = undo->king_square[COLOR_BLACK];
+    b->castling_rights = undo->castling_rights;
+    b->ep_square = undo->ep_square;
+    b->halfmove_clock = undo->halfmove_clock;
+    b->side_to_move ^= 1;
+    if(b->side_to_move == COLOR_BLACK) {
+        b->fullmove_number--;
+    }
+
+    // Every incremental update above is undone by restoring the saved key
+    // and evaluation sums
+    b->hash = undo->hash;
+    b->psq_mg = undo->psq_mg;
+    b->psq_eg = undo->psq_eg;
+    b->phase = undo->phase;
+
+#ifdef DEBUG_CHECKS
+    validate_board(b, "unmake_move");
+#endif
+}
+
+// Squares attacked by the piece on square, pawn pushes are not included
+u64 piece_attacks(u32 square, const Piece *piece, u64 occupied) {
+    switch(piece->type) {
+        case KING: return king_attacks(square);
+        case PAWN: return pawn_attacks(square, piece->color);
+        case BISHOP: return bishop_attacks(square, occupied);
+        case KNIGHT: return knight_attacks(square);
+        case ROOK: return rook_attacks(square, occupied);
+        case QUEEN: return bishop_attacks(square, occupied) | rook_attacks(square, occupied);
+        default: return 0;
+    }
+}
+
+// Pieces of either color attacking square, with sliders blocked by occupied
+u64 attackers_to(u32 square, u64 occupied, const Board *b) {
+    u64 queens = b->piece_bb[QUEEN];
+    return (pawn_attacks(square, COLOR_WHITE) & b->piece_bb[PAWN] & b->color_bb[COLOR_BLACK])
+        | (pawn_attacks(square, COLOR_BLACK) & b->piece_bb[PAWN] & b->color_bb[COLOR_WHITE])
+        | (knight_attacks(square) & b->piece_bb[KNIGHT])
+        | (king_attacks(square) & b->piece_bb[KING])
+        | (bishop_attacks(square, occupied) & (b->piece_bb[BISHOP] | queens))
+        | (rook_attacks(square, occupied) & (b->piece_bb[ROOK] | queens));
+}
+
+// Check if any piece of by_color attacks square, looking outward from the
+// square with each piece type's attack pattern
+bool is_square_attacked(u32 square, u32 by_color, const Board *b) {
+    u64 attackers = b->color_bb[by_color];
+
+    if(pawn_attacks(square, by_color ^ 1) & b->piece_bb[PAWN] & attackers) {
+        return true;
+    }
+    if(knight_attacks(square) & b->piece_bb[KNIGHT] & attackers) {
+        return true;
+    }
+    if(king_attacks(square) & b->piece_bb[KING] & attackers) {
+        return true;
+    }
+
+    u64 queens = b->piece_bb[QUEEN];
+    if(bishop_attacks(square, b->pieces_state) & (b->piece_bb[BISHOP] | queens) & attackers) {
+        return true;
+    }
+    if(rook_attacks(square, b->pieces_state) & (b->piece_bb[ROOK] | queens) & attackers) {
+        return true;
+    }
+
+    return false;
+}
+
+// Check if side with specified color in check
+bool is_in_check(u32 color, Board *b) {
+    return is_square_attacked(b->king_square[color], color ^ 1, b);
+}
+
+// FEN castling characters in the order of the CASTLE_* bits
+static const char castling_chars[] = "KQkq";
+
+// Sets b up from a FEN string. The halfmove clock and fullmove number are
+// optional, so EPD positions load too, and default to 0 and 1. Returns
+// false if the fields are malformed or describe an illegal position,
+// leaving b in an unspecified state. Castling rights without their king
+// and rook are dropped, and the en passant square is kept only if a pawn
+// can actually capture there, as make_move does. If end is not NULL it is
+// pointed past the last field read
+bool board_from_fen(Board *b, const char *fen, const char **end) {
+    static const char piece_chars[PIECE_TYPE_COUNT] = {
+        [KING] = 'k', [PAWN] = 'p', [BISHOP] = 'b', [KNIGHT] = 'n', [ROOK] = 'r', [QUEEN] = 'q'
+    };
+
+    memset(b, 0, sizeof(*b));
+    b->ep_square = NO_SQUARE;
+
+    const char *p = fen;
+    while(*p == ' ') {
+        p++;
+    }
+
+    u32 x = 0;
+    u32 y = 7;
+    for(; *p && *p != ' '; p++) {
+        if(*p == '/') {
+            if(x != 8 || y == 0) {
+                return false;
+            }
+            x = 0;
+            y--;
+        } else if(*p >= '1' && *p <= '8') {
+            x += *p - '0';
+            if(x > 8) {
+                return false;
+            }
+        } else {
+            u8 color = *p >= 'a' ? COLOR_BLACK : COLOR_WHITE;
+            char lower = color == COLOR_BLACK ? *p : *p - 'A' + 'a';
+            u8 type = PIECE_TYPE_COUNT;
+            for(u8 t = 0; t < PIECE_TYPE_COUNT; t++) {
+                if(piece_chars[t] == lower) {
+                    type = t;
                 }
             }
+            if(type == PIECE_TYPE_COUNT || x >= 8) {
+                return false;
+            }
+            set_piece(x, y, &(Piece){.type = type, .color = color}, b);
+            x++;
+        }
+    }
+    if(x != 8 || y != 0) {
+        return false;
+    }
+    for(u32 color = 0; color < 2; color++) {
+        if(POPCOUNT(b->piece_bb[KING] & b->color_bb[color]) != 1) {
+            return false;
+        }
+    }
+    if(b->piece_bb[PAWN] & (RANK_1 | RANK_8)) {
+        return false;
+    }
 
-            // Bottom right
-            x1 = x;
-            y1 = y;
-            move.capture = false;
-            while(x1 < 7 && y1 > 0) {
-                x1++;
-                y1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+    while(*p == ' ') {
+        p++;
+    }
+    if(*p == 'w') {
+        b->side_to_move = COLOR_WHITE;
+    } else if(*p == 'b') {
+        b->side_to_move = COLOR_BLACK;
+    } else {
+        return false;
+    }
+    p++;
+
+    while(*p == ' ') {
+        p++;
+    }
+    if(*p == '-') {
+        p++;
+    } else {
+        for(; *p && *p != ' '; p++) {
+            const char *right = strchr(castling_chars, *p);
+            if(!right) {
+                return false;
             }
+            b->castling_rights |= 1 << (right - castling_chars);
+        }
+    }
+    static const struct {
+        u8 right;
+        u8 color;
+        u8 king;
+        u8 rook;
+    } castling_pieces[4] = {
+        {CASTLE_WHITE_KING, COLOR_WHITE, 4, 7},
+        {CASTLE_WHITE_QUEEN, COLOR_WHITE, 4, 0},
+        {CASTLE_BLACK_KING, COLOR_BLACK, 60, 63},
+        {CASTLE_BLACK_QUEEN, COLOR_BLACK, 60, 56},
+    };
+    for(u32 i = 0; i < 4; i++) {
+        u64 own = b->color_bb[castling_pieces[i].color];
+        if(!(b->piece_bb[KING] & own & SQUARE_BIT(castling_pieces[i].king))
+            || !(b->piece_bb[ROOK] & own & SQUARE_BIT(castling_pieces[i].rook))) {
+            b->castling_rights &= ~castling_pieces[i].right;
+        }
+    }
 
-            // Bottom left
-            x1 = x;
-            y1 = y;
-            move.capture = false;
-            while(x1 > 0 && y1 > 0) {
-                x1--;
-                y1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    move.capture = true;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+    while(*p == ' ') {
+        p++;
+    }
+    if(*p == '-') {
+        p++;
+    } else if(p[0] >= 'a' && p[0] <= 'h' && (p[1] == '3' || p[1] == '6')) {
+        // Kept only when a double push can really have just happened: the
+        // square is on the right rank, the enemy pawn stands in front of it,
+        // the square and the pawn's origin are empty, and a pawn of ours can
+        // capture. Anything else is dropped like a stale castling right
+        u32 ep_square = SQUARE(p[0] - 'a', p[1] - '1');
+        u32 us = b->side_to_move;
+        u32 pawn_square = ep_square ^ 8;
+        u32 origin_square = 2 * ep_square - pawn_square;
+        if(p[1] == (us == COLOR_WHITE ? '6' : '3')
+            && (b->piece_bb[PAWN] & b->color_bb[us ^ 1] & SQUARE_BIT(pawn_square))
+            && !(b->pieces_state & (SQUARE_BIT(ep_square) | SQUARE_BIT(origin_square)))
+            && (pawn_attacks(ep_square, us ^ 1) & b->piece_bb[PAWN] & b->color_bb[us])) {
+            b->ep_square = ep_square;
+        }
+        p += 2;
+    } else if(*p) {
+        return false;
+    }
+
+    b->fullmove_number = 1;
+    const char *clocks = p;
+    while(*clocks == ' ') {
+        clocks++;
+    }
+    if(*clocks >= '0' && *clocks <= '9') {
+        char *clock_end;
+        u64 halfmove_clock = strtoul(clocks, &clock_end, 10);
+        b->halfmove_clock = (u16)MIN(halfmove_clock, UINT16_MAX);
+        p = clock_end;
+        while(*clock_end == ' ') {
+            clock_end++;
+        }
+        if(*clock_end >= '0' && *clock_end <= '9') {
+            u64 fullmove_number = strtoul(clock_end, &clock_end, 10);
+            b->fullmove_number = (u16)MAX(MIN(fullmove_number, UINT16_MAX), 1);
+            p = clock_end;
+        }
+    }
+    if(end) {
+        *end = p;
+    }
+
+    b->hash = compute_hash(b);
+    if(nnue.enabled) {
+        nnue_refresh(b);
+    }
+
+    // The side that just moved cannot have left its king in check
+    return !is_in_check(b->side_to_move ^ 1, b);
+}
+
+#define FEN_MAX_LENGTH 96
+
+// Writes the FEN string of b to out, which needs FEN_MAX_LENGTH bytes.
+// The en passant field is only set when a capture is possible, since
+// that is all the board keeps
+void board_to_fen(const Board *b, char *out) {
+    for(i32 y = 7; y >= 0; y--) {
+        u32 empty = 0;
+        for(u32 x = 0; x < 8; x++) {
+            u32 square = SQUARE(x, y);
+            if(!(b->pieces_state & SQUARE_BIT(square))) {
+                empty++;
+                continue;
             }
-            break;
+            if(empty) {
+                *out++ = '0' + empty;
+                empty = 0;
+            }
+            *out++ = piece_to_char(&b->pieces[square]);
         }
-        case KNIGHT:
+        if(empty) {
+            *out++ = '0' + empty;
+        }
+        if(y > 0) {
+            *out++ = '/';
+        }
+    }
+
+    *out++ = ' ';
+    *out++ = b->side_to_move == COLOR_WHITE ? 'w' : 'b';
+    *out++ = ' ';
+    if(!b->castling_rights) {
+        *out++ = '-';
+    }
+    for(u32 i = 0; i < 4; i++) {
+        if(b->castling_rights & (1 << i)) {
+            *out++ = castling_chars[i];
+        }
+    }
+    *out++ = ' ';
+    if(b->ep_square == NO_SQUARE) {
+        *out++ = '-';
+    } else {
+        *out++ = 'a' + SQUARE_X(b->ep_square);
+        *out++ = '1' + SQUARE_Y(b->ep_square);
+    }
+    sprintf(out, " %u %u", b->halfmove_clock, b->fullmove_number);
+}
+
+// Legal moves for the piece on square, limited to target_mask. The caller
+// folds pins, check evasions and capture-only filtering into target_mask,
+// king safety is checked here
+void generate_moves_for_piece(u32 square, u64 target_mask, u32 color_to_move, const Board *b, Move *moves, u32 *move_count) {
+    const Piece *piece = &b->pieces[square];
+    u64 enemies = b->color_bb[color_to_move ^ 1];
+    u64 targets = piece_attacks(square, piece, b->pieces_state);
+    switch(piece->type) {
+        case KING:
         {
-            // Left 1
-            if(x > 1 && y > 0 && !(get_piece(x - 2, y - 1, b) && get_piece(x - 2, y - 1, b)->color == color_to_move)) {
-                move.to.x = x - 2;
-                move.to.y = y - 1;
-                if(get_piece(x - 2, y - 1, b) && get_piece(x - 2, y - 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
-            // Left 2
-            if(x > 1 && y < 7 && !(get_piece(x - 2, y + 1, b) && get_piece(x - 2, y + 1, b)->color == color_to_move)) {
-                move.to.x = x - 2;
-                move.to.y = y + 1;
-                if(get_piece(x - 2, y + 1, b) && get_piece(x - 2, y + 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
-            // Top 1
-            if(x > 0 && y < 6 && !(get_piece(x - 1, y + 2, b) && get_piece(x - 1, y + 2, b)->color == color_to_move)) {
-                move.to.x = x - 1;
-                move.to.y = y + 2;
-                if(get_piece(x - 1, y + 2, b) && get_piece(x - 1, y + 2, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
-            // Top 2
-            if(x < 7 && y < 6 && !(get_piece(x + 1, y + 2, b) && get_piece(x + 1, y + 2, b)->color == color_to_move)) {
-                move.to.x = x + 1;
-                move.to.y = y + 2;
-                if(get_piece(x + 1, y + 2, b) && get_piece(x + 1, y + 2, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
-            // Right 1
-            if(x < 6 && y < 7 && !(get_piece(x + 2, y + 1, b) && get_piece(x + 2, y + 1, b)->color == color_to_move)) {
-                move.to.x = x + 2;
-                move.to.y = y + 1;
-                if(get_piece(x + 2, y + 1, b) && get_piece(x + 2, y + 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
-            // Right 2
-            if(x < 6 && y > 0 && !(get_piece(x + 2, y - 1, b) && get_piece(x + 2, y - 1, b)->color == color_to_move)) {
-                move.to.x = x + 2;
-                move.to.y = y - 1;
-                if(get_piece(x + 2, y - 1, b) && get_piece(x + 2, y - 1, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
+            // The king can't hide from a slider by stepping along its ray,
+            // so look for attackers with the king lifted off the board
+            u64 occupied = b->pieces_state ^ SQUARE_BIT(square);
+            u64 candidates = targets & ~b->color_bb[color_to_move] & target_mask;
+            targets = 0;
+            while(candidates) {
+                u32 to = pop_lsb(&candidates);
+                if(!(attackers_to(to, occupied, b) & enemies)) {
+                    targets |= SQUARE_BIT(to);
                 }
-                moves[i] = move;
-                i++;
-            }
-            // Bottom 1
-            if(x < 7 && y > 1 && !(get_piece(x + 1, y - 2, b) && get_piece(x + 1, y - 2, b)->color == color_to_move)) {
-                move.to.x = x + 1;
-                move.to.y = y - 2;
-                if(get_piece(x + 1, y - 2, b) && get_piece(x + 1, y - 2, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
-            }
-            // Bottom 2
-            if(x > 0 && y > 1 && !(get_piece(x - 1, y - 2, b) && get_piece(x - 1, y - 2, b)->color == color_to_move)) {
-                move.to.x = x - 1;
-                move.to.y = y - 2;
-                if(get_piece(x - 1, y - 2, b) && get_piece(x - 1, y - 2, b)->color != color_to_move) {
-                    move.capture = true;
-                } else {
-                    move.capture = false;
-                }
-                moves[i] = move;
-                i++;
             }
             break;
         }
-        case ROOK:
+        case PAWN:
         {
-            // Left
-            u32 x1 = x;
-            u32 y1 = y;
-            while(x1 > 0) {
-                x1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
-            }
-            // Top
-            x1 = x;
-            y1 = y;
-            while(y1 < 7) {
-                y1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
-            }
-            // Right
-            x1 = x;
-            y1 = y;
-            while(x1 < 7) {
-                x1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
-            }
-            // Bottom
-            x1 = x;
-            y1 = y;
-            while(y1 > 0) {
-                y1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+            u64 empty = ~b->pieces_state;
+            u64 bit = SQUARE_BIT(square);
+            targets &= enemies;
+            if(color_to_move == COLOR_WHITE) {
+                u64 single = (bit << 8) & empty;
+                targets |= single | (((single & (RANK_2 << 8)) << 8) & empty);
+            } else {
+                u64 single = (bit >> 8) & empty;
+                targets |= single | (((single & (RANK_7 >> 8)) >> 8) & empty);
             }
+            targets &= target_mask;
             break;
         }
-        case QUEEN:
+        default:
         {
-            // Left
-            u32 x1 = x;
-            u32 y1 = y;
-            while(x1 > 0) {
-                x1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
+            targets &= ~b->color_bb[color_to_move] & target_mask;
+            break;
+        }
+    }
+
+    u32 i = 0;
+    while(targets) {
+        u32 to = pop_lsb(&targets);
+        u32 flags = (enemies & SQUARE_BIT(to)) ? FLAG_CAPTURE : FLAG_QUIET;
+        if(piece->type == PAWN) {
+            if(SQUARE_BIT(to) & (RANK_1 | RANK_8)) {
+                for(i32 type = QUEEN; type >= BISHOP; type--) {
+                    moves[i] = MOVE(square, to, flags | FLAG_PROMOTION | (type - BISHOP));
                     i++;
                 }
+                continue;
             }
-            // Top left
-            x1 = x;
-            y1 = y;
-            while(x1 > 0 && y1 < 7) {
-                x1--;
-                y1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+            if(to == square + 16 || square == to + 16) {
+                flags = FLAG_DOUBLE_PUSH;
             }
-            // Top
-            x1 = x;
-            y1 = y;
-            while(y1 < 7) {
-                y1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+        }
+        moves[i] = MOVE(square, to, flags);
+        i++;
+    }
+
+    *move_count = i;
+}
+
+// Castling through or into check is illegal, and so is castling out of it,
+// which the caller rules out before getting here
+u32 generate_castling_moves(u32 color_to_move, Board *b, Move *moves) {
+    u32 i = 0;
+    u32 base = color_to_move == COLOR_WHITE ? 0 : 56;
+    u32 enemy = color_to_move ^ 1;
+    u32 rights = b->castling_rights >> (color_to_move * 2);
+
+    if((rights & CASTLE_WHITE_KING)
+        && !(b->pieces_state & (SQUARE_BIT(base + 5) | SQUARE_BIT(base + 6)))
+        && !is_square_attacked(base + 5, enemy, b)
+        && !is_square_attacked(base + 6, enemy, b)) {
+        moves[i] = MOVE(base + 4, base + 6, FLAG_KING_CASTLE);
+        i++;
+    }
+    if((rights & CASTLE_WHITE_QUEEN)
+        && !(b->pieces_state & (SQUARE_BIT(base + 1) | SQUARE_BIT(base + 2) | SQUARE_BIT(base + 3)))
+        && !is_square_attacked(base + 3, enemy, b)
+        && !is_square_attacked(base + 2, enemy, b)) {
+        moves[i] = MOVE(base + 4, base + 2, FLAG_QUEEN_CASTLE);
+        i++;
+    }
+
+    return i;
+}
+
+// En passant removes two pieces from the capturer's rank at once, which can
+// uncover a slider on the king that the pin mask doesn't know about. Each
+// candidate is checked against the occupancy after the capture instead
+u32 generate_en_passant_moves(u32 color_to_move, u64 check_mask, Board *b, Move *moves) {
+    u32 i = 0;
+    u32 ep_square = b->ep_square;
+    if(ep_square == NO_SQUARE) {
+        return 0;
+    }
+
+    u32 captured = ep_square ^ 8;
+    if(!(check_mask & (SQUARE_BIT(ep_square) | SQUARE_BIT(captured)))) {
+        return 0;
+    }
+
+    u32 king = b->king_square[color_to_move];
+    u64 enemies = b->color_bb[color_to_move ^ 1];
+    u64 queens = b->piece_bb[QUEEN];
+    u64 candidates = pawn_attacks(ep_square, color_to_move ^ 1) & b->piece_bb[PAWN] & b->color_bb[color_to_move];
+    while(candidates) {
+        u32 from = pop_lsb(&candidates);
+        u64 occupied = (b->pieces_state ^ SQUARE_BIT(from) ^ SQUARE_BIT(captured)) | SQUARE_BIT(ep_square);
+        if(bishop_attacks(king, occupied) & (b->piece_bb[BISHOP] | queens) & enemies) {
+            continue;
+        }
+        if(rook_attacks(king, occupied) & (b->piece_bb[ROOK] | queens) & enemies) {
+            continue;
+        }
+        moves[i] = MOVE(from, ep_square, FLAG_EN_PASSANT);
+        i++;
+    }
+
+    return i;
+}
+
+// Generates strictly legal moves and returns how many were written. With
+// captures_only, quiet moves other than promotions are left out.
+// out_moves must be size MAX_MOVES
+u32 generate_legal_moves(i32 color_to_move, Move *out_moves, Board *b, bool captures_only) {
+    u32 move_count = 0;
+
+    u32 king = b->king_square[color_to_move];
+    u64 own = b->color_bb[color_to_move];
+    u64 enemies = b->color_bb[color_to_move ^ 1];
+    u64 checkers = attackers_to(king, b->pieces_state, b) & enemies;
+
+    // Non-king moves have to capture the checker or block its ray. In double
+    // check only the king can move
+    u64 check_mask = ~0ULL;
+    if(POPCOUNT(checkers) > 1) {
+        check_mask = 0;
+    } else if(checkers) {
+        check_mask = checkers | between_table[king][LSB(checkers)];
+    }
+
+    // Enemy sliders that would see the king through exactly one of our
+    // pieces pin that piece to their line
+    u64 pinned = 0;
+    u64 queens = b->piece_bb[QUEEN];
+    u64 snipers = ((bishop_attacks(king, enemies) & (b->piece_bb[BISHOP] | queens))
+        | (rook_attacks(king, enemies) & (b->piece_bb[ROOK] | queens))) & enemies;
+    while(snipers) {
+        u64 blockers = between_table[king][pop_lsb(&snipers)] & b->pieces_state;
+        if(POPCOUNT(blockers) == 1) {
+            pinned |= blockers & own;
+        }
+    }
+
+    u64 filter = captures_only ? enemies : ~0ULL;
+    u64 pawn_filter = captures_only ? enemies | RANK_1 | RANK_8 : ~0ULL;
+
+    while(own) {
+        u32 square = pop_lsb(&own);
+        u64 target_mask = filter;
+        if(square != king) {
+            target_mask = (b->piece_bb[PAWN] & SQUARE_BIT(square) ? pawn_filter : filter) & check_mask;
+            if(pinned & SQUARE_BIT(square)) {
+                target_mask &= line_table[king][square];
+            }
+        }
+
+        u32 m = 0;
+        generate_moves_for_piece(square, target_mask, color_to_move, b, &out_moves[move_count], &m);
+        move_count += m;
+    }
+
+    move_count += generate_en_passant_moves(color_to_move, check_mask, b, &out_moves[move_count]);
+    if(!checkers && !captures_only) {
+        move_count += generate_castling_moves(color_to_move, b, &out_moves[move_count]);
+    }
+
+    return move_count;
+}
+
+u32 generate_moves(i32 color_to_move, Move *out_moves, Board *b) {
+    return generate_legal_moves(color_to_move, out_moves, b, false);
+}
+
+// Captures and promotions only, for quiescence search
+u32 generate_captures(i32 color_to_move, Move *out_moves, Board *b) {
+    return generate_legal_moves(color_to_move, out_moves, b, true);
+}
+
+u64 now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + (u64)ts.tv_nsec / 1000000;
+}
+
+// Time spent against the time limit, which is none while pondering
+static inline u64 search_elapsed_ms(SearchShared *shared) {
+    if(atomic_load_explicit(&shared->ponder, memory_order_relaxed)) {
+        return 0;
+    }
+    return now_ms() - atomic_load_explicit(&shared->start_ms, memory_order_relaxed);
+}
+
+// Limits are polled every 1024 nodes so the clock and the shared counters
+// stay off the hot path
+#define LIMIT_CHECK_INTERVAL 1024
+
+static inline void check_limits(SearchContext *ctx) {
+    if(ctx->nodes % LIMIT_CHECK_INTERVAL != 0) {
+        return;
+    }
+
+    SearchShared *shared = ctx->shared;
+    u64 nodes = atomic_fetch_add_explicit(&shared->nodes, LIMIT_CHECK_INTERVAL, memory_order_relaxed) + LIMIT_CHECK_INTERVAL;
+    if(shared->limits.nodes && nodes >= shared->limits.nodes) {
+        atomic_store_explicit(&shared->stop, true, memory_order_relaxed);
+    }
+    // One clock reader is enough
+    if(ctx->thread_id == 0 && shared->limits.time_ms && search_elapsed_ms(shared) >= shared->limits.time_ms) {
+        atomic_store_explicit(&shared->stop, true, memory_order_relaxed);
+    }
+    ctx->stopped = atomic_load_explicit(&shared->stop, memory_order_relaxed);
+}
+
+// Scores are from white's point of view. Mates are scored MATE_SCORE minus
+// the distance from the root, so shorter mates are preferred
+#define MATE_SCORE 30000
+#define MATE_BOUND (MATE_SCORE - MAX_PLY)
+
+#define BOUND_UPPER 0x1
+#define BOUND_LOWER 0x2
+#define BOUND_EXACT (BOUND_UPPER | BOUND_LOWER)
+
+// Transposition table entries are two words: the packed data and the key
+// XORed with it. A torn write from another thread then fails the key check
+// instead of returning a corrupt entry, so no locks are needed
+typedef struct {
+    _Atomic u64 key;
+    _Atomic u64 data;
+} TTEntry;
+
+#define TT_BUCKET_SIZE 4
+
+// One bucket fills a cache line, so a probe costs a single miss
+typedef struct {
+    _Alignas(64) TTEntry entries[TT_BUCKET_SIZE];
+} TTBucket;
+
+typedef struct {
+    Move move;
+    i16 score;
+    u8 depth;
+    u8 bound;
+} TTData;
+
+typedef struct {
+    TTBucket *buckets;
+    u64 bucket_count;
+
+    // Bumped once per search, so entries from old searches get replaced first
+    u8 age;
+} TranspositionTable;
+
+TranspositionTable tt = {0};
+
+#define TT_DEFAULT_MB 16
+#define LARGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static inline u64 tt_pack(const TTData *data, u8 age) {
+    return (u64)data->move
+        | ((u64)(u16)data->score << 16)
+        | ((u64)data->depth << 32)
+        | ((u64)data->bound << 40)
+        | ((u64)age << 48);
+}
+
+static inline void tt_unpack(u64 packed, TTData *data) {
+    data->move = (Move)packed;
+    data->score = (i16)(u16)(packed >> 16);
+    data->depth = (u8)(packed >> 32);
+    data->bound = (u8)(packed >> 40) & BOUND_EXACT;
+}
+
+static inline u8 tt_entry_age(u64 packed) {
+    return (u8)(packed >> 48);
+}
+
+void tt_clear(void) {
+    memset(tt.buckets, 0, tt.bucket_count * sizeof(TTBucket));
+    tt.age = 0;
+}
+
+// Reallocates the table to size_mb megabytes. With large_pages the block is
+// aligned to 2 MB and handed to the kernel as a transparent huge page
+// candidate, which cuts TLB misses on big tables
+void tt_resize(u64 size_mb, bool large_pages) {
+    free(tt.buckets);
+
+    u64 size = MAX(size_mb, 1) * 1024 * 1024;
+    tt.bucket_count = size / sizeof(TTBucket);
+    size = tt.bucket_count * sizeof(TTBucket);
+
+    if(large_pages) {
+        tt.buckets = engine_alloc(LARGE_PAGE_SIZE, size);
+#ifdef MADV_HUGEPAGE
+        madvise(tt.buckets, size, MADV_HUGEPAGE);
+#endif
+    } else {
+        tt.buckets = engine_alloc(_Alignof(TTBucket), size);
+    }
+
+    tt_clear();
+}
+
+void tt_new_search(void) {
+    tt.age++;
+}
+
+static inline TTBucket *tt_bucket(u64 hash) {
+    // Multiply-high maps the key onto any bucket count, not just powers of two
+    __extension__ typedef unsigned __int128 u128;
+    return &tt.buckets[(u64)(((u128)hash * tt.bucket_count) >> 64)];
+}
+
+bool tt_probe(u64 hash, TTData *out) {
+    TTBucket *bucket = tt_bucket(hash);
+    for(u32 i = 0; i < TT_BUCKET_SIZE; i++) {
+        TTEntry *entry = &bucket->entries[i];
+        u64 data = atomic_load_explicit(&entry->data, memory_order_relaxed);
+        u64 key = atomic_load_explicit(&entry->key, memory_order_relaxed);
+        if((key ^ data) == hash && data) {
+            tt_unpack(data, out);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Overwrites the entry for the same key if there is one, otherwise the
+// entry with the lowest depth, counting entries from older searches as
+// shallower
+void tt_store(u64 hash, Move move, i32 score, u32 depth, u32 bound) {
+    TTBucket *bucket = tt_bucket(hash);
+    TTEntry *replace = NULL;
+    i32 replace_worth = INT_MAX;
+    u64 replace_data = 0;
+    bool same_key = false;
+
+    for(u32 i = 0; i < TT_BUCKET_SIZE; i++) {
+        TTEntry *entry = &bucket->entries[i];
+        u64 data = atomic_load_explicit(&entry->data, memory_order_relaxed);
+        u64 key = atomic_load_explicit(&entry->key, memory_order_relaxed);
+        if((key ^ data) == hash) {
+            replace = entry;
+            replace_data = data;
+            same_key = true;
+            break;
+        }
+
+        i32 worth = (i32)(u8)(data >> 32) - 8 * (u8)(tt.age - tt_entry_age(data));
+        if(worth < replace_worth) {
+            replace = entry;
+            replace_worth = worth;
+            replace_data = data;
+        }
+    }
+
+    TTData new_data = {
+        .move = move,
+        .score = (i16)score,
+        .depth = (u8)MIN(depth, 255),
+        .bound = (u8)bound
+    };
+
+    // Keep the old best move when this search didn't find one
+    if(move == MOVE_NONE && same_key) {
+        new_data.move = (Move)replace_data;
+    }
+
+    u64 packed = tt_pack(&new_data, tt.age);
+    atomic_store_explicit(&replace->data, packed, memory_order_relaxed);
+    atomic_store_explicit(&replace->key, hash ^ packed, memory_order_relaxed);
+}
+
+// Permille of sampled entries written during the current search
+u32 tt_hashfull(void) {
+    u64 samples = MIN(tt.bucket_count, 1000 / TT_BUCKET_SIZE);
+    u32 used = 0;
+    for(u64 i = 0; i < samples; i++) {
+        for(u32 j = 0; j < TT_BUCKET_SIZE; j++) {
+            u64 data = atomic_load_explicit(&tt.buckets[i].entries[j].data, memory_order_relaxed);
+            if(data && tt_entry_age(data) == tt.age) {
+                used++;
+            }
+        }
+    }
+    return samples ? (u32)(used * 1000 / (samples * TT_BUCKET_SIZE)) : 0;
+}
+
+// Mate scores are stored relative to the node rather than the root, so
+// they stay correct when the position is reached at a different ply
+static inline i32 score_to_tt(i32 score, i32 ply) {
+    if(score >= MATE_BOUND) {
+        return score + ply;
+    } else if(score <= -MATE_BOUND) {
+        return score - ply;
+    }
+    return score;
+}
+
+static inline i32 score_from_tt(i32 score, i32 ply) {
+    if(score >= MATE_BOUND) {
+        return score - ply;
+    } else if(score <= -MATE_BOUND) {
+        return score + ply;
+    }
+    return score;
+}
+
+// Syzygy endgame tablebases. Tables are found by material when a path is
+// set, and mapped and parsed the first time a search needs them. WDL
+// tables hold the result with the side to move, DTZ tables the distance to
+// the next capture or pawn move on the way to it, which the root uses to
+// make progress. Decoding follows the reference layout of the format: the
+// position is mirrored so the table's stronger side is white, turned into
+// an index over the remaining piece placements, and that index looked up
+// in blocks compressed by recursive pairing with a canonical Huffman code
+#define TB_PIECES 7
+#define TB_WDL 0
+#define TB_DTZ 1
+
+// Known wins and losses stay below every mate score, so the search keeps
+// looking for an actual mate from a won ending
+#define TB_WIN_SCORE (MATE_BOUND - MAX_PLY - 1)
+
+#define TB_MAX_SYMBOLS 4096
+#define TB_MAX_SYMBOL_LENGTH 32
+#define TB_MAX_DTZ 262144
+
+// Flags of a compressed table. All but the last are for DTZ tables
+#define TB_FLAG_STM 0x1
+#define TB_FLAG_MAPPED 0x2
+#define TB_FLAG_WIN_PLIES 0x4
+#define TB_FLAG_LOSS_PLIES 0x8
+#define TB_FLAG_WIDE 0x10
+#define TB_FLAG_SINGLE_VALUE 0x80
+
+#define TB_UNMAPPED 0
+#define TB_READY 1
+#define TB_MISSING 2
+
+enum {
+    TB_OK,
+    TB_FAIL,
+    // DTZ tables store one side to move, the probe has to go one ply deeper
+    TB_CHANGE_STM,
+    // The best move captures or pushes a pawn, so DTZ is already known
+    TB_ZEROING_BEST_MOVE
+};
+
+// One compressed table, for one side to move and, with pawns, one file of
+// the leading pawn. The pointers are into the mapped file
+typedef struct {
+    u8 flags;
+    u8 min_symbol_length;
+    u8 max_symbol_length;
+    u32 block_count;
+    u64 block_size;
+    u64 span;
+
+    // Little-endian u16 per code length, the first symbol of that length
+    const u8 *lowest_symbol;
+    // Every symbol as a pair of 12-bit symbols, packed into 3 bytes
+    const u8 *btree;
+    // Little-endian u16 per block, its number of values minus one
+    const u8 *block_length;
+    u32 block_length_size;
+    // Every span-th value: a u32 block and a u16 offset into it
+    const u8 *sparse_index;
+    u64 sparse_index_size;
+    const u8 *data;
+
+    // Left-aligned first code of every length, for canonical decoding
+    u64 base[TB_MAX_SYMBOL_LENGTH];
+    // Number of values a symbol expands to, minus one
+    u8 *symbol_length;
+    u32 symbol_count;
+
+    // Pieces in the order the table encodes them, as 1-6 for pawn to king
+    // plus 8 for black, and how they are grouped into the index
+    u8 pieces[TB_PIECES];
+    u64 group_index[TB_PIECES + 1];
+    u8 group_length[TB_PIECES + 1];
+
+    // Offsets of the four DTZ value maps, one per WDL result
+    u16 map_index[4];
+} TBPairs;
+
+typedef struct {
+    _Atomic u8 state;
+    const u8 *data;
+    size_t size;
+
+    // Indexed by side * 4 + file
+    TBPairs *pairs;
+    const u8 *dtz_map;
+} TBFileMap;
+
+typedef struct {
+    // e.g. KRPvKR, white being the stronger side
+    char name[TB_PIECES + 2];
+    const char *directory;
+
+    // Material of the table as named, and with the colors swapped
+    u64 key;
+    u64 key2;
+    u8 piece_count;
+    bool has_pawns;
+    bool has_unique_pieces;
+    // Pawns of the leading color, then of the other one
+    u8 pawn_count[2];
+
+    TBFileMap maps[2];
+} TBTable;
+
+typedef struct {
+    TBTable *tables;
+    u32 count;
+    u32 capacity;
+    // Open addressing on material keys, each slot a table index plus one
+    u32 *index;
+    u32 index_mask;
+
+    // Copy of the path with the separators replaced by terminators
+    char *directories;
+    u32 max_pieces;
+
+    // Positions with more pieces, or searched at less than probe_depth
+    // with exactly probe_limit pieces, are left to the search.
+    // cardinality is probe_limit capped to the tables found
+    u32 probe_depth;
+    u32 probe_limit;
+    u32 cardinality;
+
+    pthread_mutex_t mutex;
+} Tablebases;
+
+Tablebases tb = {
+    .probe_depth = 1,
+    .probe_limit = TB_PIECES,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static i32 tb_map_b1h1h7[64];
+static i32 tb_map_a1d1d4[64];
+static i32 tb_map_kk[10][64];
+static i32 tb_map_pawns[64];
+static u64 tb_binomial[TB_PIECES][64];
+static u64 tb_lead_pawn_index[TB_PIECES][64];
+static u64 tb_lead_pawns_size[TB_PIECES][4];
+
+// Table piece codes by PieceType
+static const u8 tb_piece_codes[PIECE_TYPE_COUNT] = {6, 1, 3, 2, 4, 5};
+
+// Rank minus file: negative below the a1-h8 diagonal, zero on it
+static inline i32 tb_off_diagonal(u32 square) {
+    return (i32)SQUARE_Y(square) - (i32)SQUARE_X(square);
+}
+
+void init_tablebase_tables(void) {
+    // Squares below the a1-h8 diagonal, as 0-27
+    i32 code = 0;
+    for(u32 square = 0; square < 64; square++) {
+        if(tb_off_diagonal(square) < 0) {
+            tb_map_b1h1h7[square] = code++;
+        }
+    }
+
+    // The a1-d1-d4 triangle as 0-9, the diagonal squares last
+    code = 0;
+    u32 diagonal[4];
+    u32 diagonal_count = 0;
+    for(u32 square = 0; square <= SQUARE(3, 3); square++) {
+        if(SQUARE_X(square) > 3) {
+            continue;
+        }
+        if(tb_off_diagonal(square) < 0) {
+            tb_map_a1d1d4[square] = code++;
+        } else if(tb_off_diagonal(square) == 0) {
+            diagonal[diagonal_count++] = square;
+        }
+    }
+    for(u32 i = 0; i < diagonal_count; i++) {
+        tb_map_a1d1d4[diagonal[i]] = code++;
+    }
+
+    // The 462 legal placements of two kings with the first one in the
+    // triangle. With the first king on the diagonal the second one is not
+    // above it, and placements with both on the diagonal come last
+    u32 both_on_diagonal[64][2];
+    u32 both_count = 0;
+    code = 0;
+    for(i32 index = 0; index < 10; index++) {
+        for(u32 s1 = 0; s1 <= SQUARE(3, 3); s1++) {
+            if(tb_map_a1d1d4[s1] != index || (index == 0 && s1 != SQUARE(1, 0))) {
+                continue;
+            }
+            for(u32 s2 = 0; s2 < 64; s2++) {
+                if((king_attacks(s1) | SQUARE_BIT(s1)) & SQUARE_BIT(s2)) {
+                    continue;
+                } else if(!tb_off_diagonal(s1) && tb_off_diagonal(s2) > 0) {
+                    continue;
+                } else if(!tb_off_diagonal(s1) && !tb_off_diagonal(s2)) {
+                    both_on_diagonal[both_count][0] = index;
+                    both_on_diagonal[both_count][1] = s2;
+                    both_count++;
+                } else {
+                    tb_map_kk[index][s2] = code++;
+                }
+            }
+        }
+    }
+    for(u32 i = 0; i < both_count; i++) {
+        tb_map_kk[both_on_diagonal[i][0]][both_on_diagonal[i][1]] = code++;
+    }
+
+    // tb_binomial[k][n] ways to choose k squares out of n
+    tb_binomial[0][0] = 1;
+    for(u32 n = 1; n < 64; n++) {
+        for(u32 k = 0; k < TB_PIECES && k <= n; k++) {
+            tb_binomial[k][n] = (k > 0 ? tb_binomial[k - 1][n - 1] : 0) + (k < n ? tb_binomial[k][n - 1] : 0);
+        }
+    }
+
+    // Pawn squares by how many squares are left for the other leading
+    // pawns: the leading pawn is the one nearest the edge and, on the same
+    // file, the lowest. Leading pawn indexes restart on every file, since
+    // each file has its own table
+    i32 available = 47;
+    for(u32 lead_count = 1; lead_count <= 5; lead_count++) {
+        for(u32 file = 0; file < 4; file++) {
+            u64 index = 0;
+            for(u32 rank = 1; rank <= 6; rank++) {
+                u32 square = SQUARE(file, rank);
+                if(lead_count == 1) {
+                    tb_map_pawns[square] = available--;
+                    tb_map_pawns[square ^ 7] = available--;
+                }
+                tb_lead_pawn_index[lead_count][square] = index;
+                index += tb_binomial[lead_count - 1][tb_map_pawns[square]];
+            }
+            tb_lead_pawns_size[lead_count][file] = index;
+        }
+    }
+}
+
+// Pieces of each type and color packed into 4 bits apiece
+static inline u64 tb_material_key(const u8 white[PIECE_TYPE_COUNT], const u8 black[PIECE_TYPE_COUNT]) {
+    u64 key = 0;
+    for(u32 type = 0; type < PIECE_TYPE_COUNT; type++) {
+        key |= (u64)white[type] << (4 * type);
+        key |= (u64)black[type] << (4 * (type + PIECE_TYPE_COUNT));
+    }
+    return key;
+}
+
+static inline u64 tb_board_key(const Board *b) {
+    u8 counts[2][PIECE_TYPE_COUNT];
+    for(u32 color = 0; color < 2; color++) {
+        for(u32 type = 0; type < PIECE_TYPE_COUNT; type++) {
+            counts[color][type] = (u8)POPCOUNT(b->piece_bb[type] & b->color_bb[color]);
+        }
+    }
+    return tb_material_key(counts[COLOR_WHITE], counts[COLOR_BLACK]);
+}
+
+static inline u32 tb_slot(u64 key) {
+    return (u32)((key * 0x9E3779B97F4A7C15ull) >> 40) & tb.index_mask;
+}
+
+TBTable *tb_find(u64 key) {
+    if(!tb.count) {
+        return NULL;
+    }
+    for(u32 slot = tb_slot(key); tb.index[slot]; slot = (slot + 1) & tb.index_mask) {
+        TBTable *table = &tb.tables[tb.index[slot] - 1];
+        if(table->key == key || table->key2 == key) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+static void tb_unmap(TBFileMap *map) {
+    if(map->pairs) {
+        for(u32 i = 0; i < 8; i++) {
+            free(map->pairs[i].symbol_length);
+        }
+        free(map->pairs);
+    }
+    if(map->data) {
+        munmap((void *)map->data, map->size);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+void tb_free(void) {
+    for(u32 i = 0; i < tb.count; i++) {
+        tb_unmap(&tb.tables[i].maps[TB_WDL]);
+        tb_unmap(&tb.tables[i].maps[TB_DTZ]);
+    }
+    free(tb.tables);
+    free(tb.index);
+    free(tb.directories);
+    tb.tables = NULL;
+    tb.index = NULL;
+    tb.directories = NULL;
+    tb.count = 0;
+    tb.capacity = 0;
+    tb.max_pieces = 0;
+    tb.cardinality = 0;
+}
+
+static void tb_add(const char *name, const char *directory) {
+    if(tb.count == tb.capacity) {
+        tb.capacity = MAX(tb.capacity * 2, 64);
+        TBTable *tables = engine_alloc(_Alignof(TBTable), tb.capacity * sizeof(TBTable));
+        if(tb.count) {
+            memcpy(tables, tb.tables, tb.count * sizeof(TBTable));
+        }
+        free(tb.tables);
+        tb.tables = tables;
+    }
+
+    TBTable *table = &tb.tables[tb.count++];
+    memset(table, 0, sizeof(*table));
+    strcpy(table->name, name);
+    table->directory = directory;
+
+    u8 counts[2][PIECE_TYPE_COUNT] = {{0}};
+    u32 side = 0;
+    for(const char *c = name; *c; c++) {
+        if(*c == 'v') {
+            side = 1;
+            continue;
+        }
+        PieceType type = *c == 'K' ? KING : *c == 'Q' ? QUEEN : *c == 'R' ? ROOK
+            : *c == 'B' ? BISHOP : *c == 'N' ? KNIGHT : PAWN;
+        counts[side][type]++;
+        table->piece_count++;
+        table->has_pawns |= type == PAWN;
+    }
+    // Kings do not count as unique pieces
+    for(u32 color = 0; color < 2; color++) {
+        for(u32 type = PAWN; type < PIECE_TYPE_COUNT; type++) {
+            table->has_unique_pieces |= counts[color][type] == 1;
+        }
+    }
+    table->key = tb_material_key(counts[0], counts[1]);
+    table->key2 = tb_material_key(counts[1], counts[0]);
+
+    // With pawns on both sides the side with fewer pawns leads, as it
+    // compresses better
+    u8 white_pawns = counts[0][PAWN];
+    u8 black_pawns = counts[1][PAWN];
+    bool white_leads = !black_pawns || (white_pawns && black_pawns >= white_pawns);
+    table->pawn_count[0] = white_leads ? white_pawns : black_pawns;
+    table->pawn_count[1] = white_leads ? black_pawns : white_pawns;
+
+    tb.max_pieces = MAX(tb.max_pieces, table->piece_count);
+}
+
+// Registers name if one of the directories has its WDL file
+static void tb_try_add(const char *name) {
+    char path[PATH_MAX];
+    for(const char *directory = tb.directories; *directory; directory += strlen(directory) + 1) {
+        snprintf(path, sizeof(path), "%s/%s.rtbw", directory, name);
+        if(access(path, R_OK) == 0) {
+            tb_add(name, directory);
+            return;
+        }
+    }
+}
+
+// Walks every material signature of up to TB_PIECES pieces, white's pieces
+// then black's, each side in QRBNP order
+static void tb_discover(char *name, u32 length, u32 next, u32 pieces, bool black) {
+    if(black) {
+        name[length] = '\0';
+        tb_try_add(name);
+    } else {
+        name[length] = 'v';
+        name[length + 1] = 'K';
+        tb_discover(name, length + 2, 0, pieces + 1, true);
+    }
+
+    // White leaves room for the black king
+    if(pieces >= (black ? TB_PIECES : TB_PIECES - 1)) {
+        return;
+    }
+    static const char piece_chars[] = "QRBNP";
+    for(u32 i = next; i < 5; i++) {
+        name[length] = piece_chars[i];
+        tb_discover(name, length + 1, i, pieces + 1, black);
+    }
+}
+
+// Finds the tables in path, a list of directories separated by colons,
+// replacing any found before. An empty path turns probing off
+void tb_init(const char *path) {
+    tb_free();
+    if(!path || !*path || strcmp(path, "<empty>") == 0) {
+        return;
+    }
+
+    size_t length = strlen(path);
+    tb.directories = engine_alloc(1, length + 2);
+    memcpy(tb.directories, path, length + 1);
+    for(char *c = tb.directories; *c; c++) {
+        if(*c == ':') {
+            *c = '\0';
+        }
+    }
+    // Double terminator ends the list
+    tb.directories[length + 1] = '\0';
+
+    char name[TB_PIECES + 2] = "K";
+    tb_discover(name, 1, 0, 1, false);
+    if(!tb.count) {
+        return;
+    }
+
+    u32 slots = 1;
+    while(slots < tb.count * 4) {
+        slots *= 2;
+    }
+    tb.index = engine_alloc(_Alignof(u32), slots * sizeof(u32));
+    memset(tb.index, 0, slots * sizeof(u32));
+    tb.index_mask = slots - 1;
+    for(u32 i = 0; i < tb.count; i++) {
+        u32 slot = tb_slot(tb.tables[i].key);
+        while(tb.index[slot]) {
+            slot = (slot + 1) & tb.index_mask;
+        }
+        tb.index[slot] = i + 1;
+    }
+    tb.cardinality = MIN(tb.probe_limit, tb.max_pieces);
+}
+
+void tb_set_probe_limit(u32 limit) {
+    tb.probe_limit = limit;
+    tb.cardinality = MIN(tb.probe_limit, tb.max_pieces);
+}
+
+// Values a symbol expands to, minus one. Symbols are pairs of smaller
+// symbols except the leaves, whose right side is 0xFFF
+static u8 tb_expand_length(TBPairs *d, u32 symbol, bool *visited) {
+    visited[symbol] = true;
+    const u8 *pair = d->btree + 3 * symbol;
+    u32 left = ((pair[1] & 0xF) << 8) | pair[0];
+    u32 right = (pair[2] << 4) | (pair[1] >> 4);
+    if(right == 0xFFF) {
+        return 0;
+    }
+    if(!visited[left]) {
+        d->symbol_length[left] = tb_expand_length(d, left, visited);
+    }
+    if(!visited[right]) {
+        d->symbol_length[right] = tb_expand_length(d, right, visited);
+    }
+    return d->symbol_length[left] + d->symbol_length[right] + 1;
+}
+
+static inline u32 tb_left(const TBPairs *d, u32 symbol) {
+    const u8 *pair = d->btree + 3 * symbol;
+    return ((pair[1] & 0xF) << 8) | pair[0];
+}
+
+static inline u32 tb_right(const TBPairs *d, u32 symbol) {
+    const u8 *pair = d->btree + 3 * symbol;
+    return (pair[2] << 4) | (pair[1] >> 4);
+}
+
+// Reads the header of one compressed table. Returns the byte after it, or
+// NULL if the code lengths are out of range
+static const u8 *tb_parse_sizes(TBPairs *d, const u8 *data) {
+    d->flags = *data++;
+    if(d->flags & TB_FLAG_SINGLE_VALUE) {
+        // Every position has the same value, kept in min_symbol_length
+        d->min_symbol_length = *data++;
+        return data;
+    }
+
+    u32 groups = 0;
+    while(d->group_length[groups]) {
+        groups++;
+    }
+    u64 size = d->group_index[groups];
+    d->block_size = 1ULL << *data++;
+    d->span = 1ULL << *data++;
+    d->sparse_index_size = (size + d->span - 1) / d->span;
+    u8 padding = *data++;
+    d->block_count = (u32)read_le(data, 4);
+    data += 4;
+    // Padded so the sparse index never points past the end
+    d->block_length_size = d->block_count + padding;
+    d->max_symbol_length = *data++;
+    d->min_symbol_length = *data++;
+    if(d->min_symbol_length == 0 || d->max_symbol_length < d->min_symbol_length
+        || d->max_symbol_length > TB_MAX_SYMBOL_LENGTH) {
+        return NULL;
+    }
+    d->lowest_symbol = data;
+
+    // Canonical Huffman code: the first code of each length follows from
+    // the next longer one and the number of symbols between them
+    u32 lengths = d->max_symbol_length - d->min_symbol_length + 1;
+    d->base[lengths - 1] = 0;
+    for(i32 i = (i32)lengths - 2; i >= 0; i--) {
+        d->base[i] = (d->base[i + 1] + read_le(data + 2 * i, 2) - read_le(data + 2 * (i + 1), 2)) / 2;
+    }
+    for(u32 i = 0; i < lengths; i++) {
+        d->base[i] <<= 64 - i - d->min_symbol_length;
+    }
+    data += 2 * lengths;
+
+    d->symbol_count = (u32)read_le(data, 2);
+    data += 2;
+    if(d->symbol_count > TB_MAX_SYMBOLS) {
+        return NULL;
+    }
+    d->btree = data;
+    d->symbol_length = engine_alloc(1, MAX(d->symbol_count, 1));
+    bool visited[TB_MAX_SYMBOLS] = {0};
+    for(u32 symbol = 0; symbol < d->symbol_count; symbol++) {
+        if(!visited[symbol]) {
+            d->symbol_length[symbol] = tb_expand_length(d, symbol, visited);
+        }
+    }
+    return data + 3 * d->symbol_count + (d->symbol_count & 1);
+}
+
+// Splits the pieces into the groups the index is built from and the
+// factor each group's index is scaled by. order gives the position of the
+// leading group and of the other side's pawns in that product
+static void tb_set_groups(const TBTable *table, TBPairs *d, const i32 order[2], u32 file) {
+    u32 n = 0;
+    i32 first_length = table->has_pawns ? 0 : table->has_unique_pieces ? 3 : 2;
+    d->group_length[n] = 1;
+    for(u32 i = 1; i < table->piece_count; i++) {
+        if(--first_length > 0 || d->pieces[i] == d->pieces[i - 1]) {
+            d->group_length[n]++;
+        } else {
+            d->group_length[++n] = 1;
+        }
+    }
+    d->group_length[++n] = 0;
+
+    bool both_pawns = table->has_pawns && table->pawn_count[1];
+    u32 next = both_pawns ? 2 : 1;
+    u32 free_squares = 64 - d->group_length[0] - (both_pawns ? d->group_length[1] : 0);
+    u64 index = 1;
+    for(i32 k = 0; next < n || k == order[0] || k == order[1]; k++) {
+        if(k == order[0]) {
+            d->group_index[0] = index;
+            index *= table->has_pawns ? tb_lead_pawns_size[d->group_length[0]][file]
+                : table->has_unique_pieces ? 31332 : 462;
+        } else if(k == order[1]) {
+            d->group_index[1] = index;
+            index *= tb_binomial[d->group_length[1]][48 - d->group_length[0]];
+        } else {
+            d->group_index[next] = index;
+            index *= tb_binomial[d->group_length[next]][free_squares];
+            free_squares -= d->group_length[next++];
+        }
+    }
+    d->group_index[n] = index;
+}
+
+static inline TBPairs *tb_pairs(const TBTable *table, const TBFileMap *map, u32 type, u32 side, u32 file) {
+    u32 sides = type == TB_WDL && table->key != table->key2 ? 2 : 1;
+    return &map->pairs[(side % sides) * 4 + (table->has_pawns ? file : 0)];
+}
+
+// Lays the tables of a mapped file out over its data
+static bool tb_parse(TBTable *table, TBFileMap *map, u32 type) {
+    const u8 *data = map->data + 4;
+    if(((*data & 0x2) != 0) != table->has_pawns || ((*data & 0x1) != 0) != (table->key != table->key2)) {
+        return false;
+    }
+    data++;
+
+    u32 sides = type == TB_WDL && table->key != table->key2 ? 2 : 1;
+    u32 max_file = table->has_pawns ? 3 : 0;
+    bool both_pawns = table->has_pawns && table->pawn_count[1];
+    for(u32 file = 0; file <= max_file; file++) {
+        i32 order[2][2] = {
+            {data[0] & 0xF, both_pawns ? data[1] & 0xF : 0xF},
+            {data[0] >> 4, both_pawns ? data[1] >> 4 : 0xF},
+        };
+        data += 1 + both_pawns;
+        for(u32 k = 0; k < table->piece_count; k++, data++) {
+            for(u32 side = 0; side < sides; side++) {
+                tb_pairs(table, map, type, side, file)->pieces[k] = side ? *data >> 4 : *data & 0xF;
+            }
+        }
+        for(u32 side = 0; side < sides; side++) {
+            tb_set_groups(table, tb_pairs(table, map, type, side, file), order[side], file);
+        }
+    }
+    data += (uintptr_t)data & 1;
+
+    for(u32 file = 0; file <= max_file; file++) {
+        for(u32 side = 0; side < sides; side++) {
+            data = tb_parse_sizes(tb_pairs(table, map, type, side, file), data);
+            if(!data) {
+                return false;
+            }
+        }
+    }
+
+    if(type == TB_DTZ) {
+        map->dtz_map = data;
+        for(u32 file = 0; file <= max_file; file++) {
+            TBPairs *d = tb_pairs(table, map, type, 0, file);
+            if(!(d->flags & TB_FLAG_MAPPED)) {
+                continue;
+            }
+            if(d->flags & TB_FLAG_WIDE) {
+                data += (uintptr_t)data & 1;
+                for(u32 i = 0; i < 4; i++) {
+                    d->map_index[i] = (u16)((data - map->dtz_map) / 2 + 1);
+                    data += 2 * read_le(data, 2) + 2;
+                }
+            } else {
+                for(u32 i = 0; i < 4; i++) {
+                    d->map_index[i] = (u16)(data - map->dtz_map + 1);
+                    data += *data + 1;
+                }
+            }
+        }
+        data += (uintptr_t)data & 1;
+    }
+
+    for(u32 file = 0; file <= max_file; file++) {
+        for(u32 side = 0; side < sides; side++) {
+            TBPairs *d = tb_pairs(table, map, type, side, file);
+            d->sparse_index = data;
+            data += 6 * d->sparse_index_size;
+        }
+    }
+    for(u32 file = 0; file <= max_file; file++) {
+        for(u32 side = 0; side < sides; side++) {
+            TBPairs *d = tb_pairs(table, map, type, side, file);
+            d->block_length = data;
+            data += 2 * (u64)d->block_length_size;
+        }
+    }
+    for(u32 file = 0; file <= max_file; file++) {
+        for(u32 side = 0; side < sides; side++) {
+            TBPairs *d = tb_pairs(table, map, type, side, file);
+            data = (const u8 *)(((uintptr_t)data + 63) & ~(uintptr_t)63);
+            d->data = data;
+            data += d->block_count * d->block_size;
+        }
+    }
+    return data <= map->data + map->size;
+}
+
+// Maps and parses a table file the first time it is probed. Threads race
+// here only once per file, later probes see the state without locking
+static bool tb_map(TBTable *table, u32 type) {
+    TBFileMap *map = &table->maps[type];
+    u8 state = atomic_load_explicit(&map->state, memory_order_acquire);
+    if(state != TB_UNMAPPED) {
+        return state == TB_READY;
+    }
+
+    pthread_mutex_lock(&tb.mutex);
+    if(atomic_load_explicit(&map->state, memory_order_relaxed) == TB_UNMAPPED) {
+        static const u8 magic[2][4] = {{0x71, 0xE8, 0x23, 0x5D}, {0xD7, 0x66, 0x0C, 0xA5}};
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s.%s", table->directory, table->name, type == TB_WDL ? "rtbw" : "rtbz");
+
+        state = TB_MISSING;
+        i32 fd = open(path, O_RDONLY);
+        struct stat st;
+        if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size % 64 == 16) {
+            void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(data != MAP_FAILED) {
+                madvise(data, st.st_size, MADV_RANDOM);
+                map->data = data;
+                map->size = st.st_size;
+                map->pairs = engine_alloc(_Alignof(TBPairs), 8 * sizeof(TBPairs));
+                memset(map->pairs, 0, 8 * sizeof(TBPairs));
+                if(memcmp(data, magic[type], 4) == 0 && tb_parse(table, map, type)) {
+                    state = TB_READY;
+                }
+            }
+        }
+        if(fd >= 0) {
+            close(fd);
+        }
+        if(state != TB_READY) {
+            fprintf(stderr, "Cannot use tablebase file %s\n", path);
+            tb_unmap(map);
+        }
+        atomic_store_explicit(&map->state, state, memory_order_release);
+    }
+    pthread_mutex_unlock(&tb.mutex);
+
+    return atomic_load_explicit(&map->state, memory_order_acquire) == TB_READY;
+}
+
+// Value number index of a compressed table. The sparse index gives a block
+// and offset near it, and the block is decoded symbol by symbol until the
+// one holding the value, whose pairs are then expanded down to it
+static i32 tb_decompress(const TBPairs *d, u64 index) {
+    if(d->flags & TB_FLAG_SINGLE_VALUE) {
+        return d->min_symbol_length;
+    }
+
+    const u8 *sparse = d->sparse_index + 6 * (index / d->span);
+    u32 block = (u32)read_le(sparse, 4);
+    i64 offset = (i64)read_le(sparse + 4, 2) + (i64)(index % d->span) - (i64)(d->span / 2);
+    while(offset < 0) {
+        block--;
+        offset += (i64)read_le(d->block_length + 2 * block, 2) + 1;
+    }
+    while(offset > (i64)read_le(d->block_length + 2 * block, 2)) {
+        offset -= (i64)read_le(d->block_length + 2 * block, 2) + 1;
+        block++;
+    }
+
+    const u8 *p = d->data + (u64)block * d->block_size;
+    u64 buffer = read_be(p, 8);
+    p += 8;
+    i32 buffer_bits = 64;
+    u32 symbol;
+    for(;;) {
+        u32 length = 0;
+        while(buffer < d->base[length]) {
+            length++;
+        }
+        symbol = (u32)((buffer - d->base[length]) >> (64 - length - d->min_symbol_length));
+        symbol += (u32)read_le(d->lowest_symbol + 2 * length, 2);
+        if(offset < d->symbol_length[symbol] + 1) {
+            break;
+        }
+        offset -= d->symbol_length[symbol] + 1;
+
+        length += d->min_symbol_length;
+        buffer <<= length;
+        buffer_bits -= length;
+        if(buffer_bits <= 32) {
+            buffer_bits += 32;
+            buffer |= read_be(p, 4) << (64 - buffer_bits);
+            p += 4;
+        }
+    }
+
+    while(d->symbol_length[symbol]) {
+        u32 left = tb_left(d, symbol);
+        if(offset < d->symbol_length[left] + 1) {
+            symbol = left;
+        } else {
+            offset -= d->symbol_length[left] + 1;
+            symbol = tb_right(d, symbol);
+        }
+    }
+    return (i32)tb_left(d, symbol);
+}
+
+// Converts a raw DTZ value to plies, for a position whose WDL is wdl
+static i32 tb_dtz_value(const TBFileMap *map, const TBPairs *d, i32 value, i32 wdl) {
+    static const u32 map_by_wdl[5] = {1, 3, 0, 2, 0};
+    if(d->flags & TB_FLAG_MAPPED) {
+        u32 index = d->map_index[map_by_wdl[wdl + 2]] + value;
+        value = d->flags & TB_FLAG_WIDE ? (i32)read_le(map->dtz_map + 2 * index, 2) : map->dtz_map[index];
+    }
+    // Stored in moves unless flagged otherwise
+    if((wdl == 2 && !(d->flags & TB_FLAG_WIN_PLIES))
+        || (wdl == -2 && !(d->flags & TB_FLAG_LOSS_PLIES))
+        || wdl == 1 || wdl == -1) {
+        value *= 2;
+    }
+    return value + 1;
+}
+
+static inline void tb_sort_squares(u32 *squares, u32 count, bool by_pawn_map) {
+    for(u32 i = 1; i < count; i++) {
+        u32 square = squares[i];
+        u32 key = by_pawn_map ? (u32)tb_map_pawns[square] : square;
+        u32 j = i;
+        for(; j > 0 && (by_pawn_map ? (u32)tb_map_pawns[squares[j - 1]] : squares[j - 1]) > key; j--) {
+            squares[j] = squares[j - 1];
+        }
+        squares[j] = square;
+    }
+}
+
+// Looks b up in its table. WDL results are -2 to 2 for loss, loss saved
+// by the fifty move rule, draw, win spoiled by it and win. DTZ needs the
+// WDL result of b and returns plies
+static i32 tb_probe_table(Board *b, u32 type, i32 wdl, i32 *state) {
+    // KvK has no table
+    if(POPCOUNT(b->pieces_state) == 2) {
+        return 0;
+    }
+    u64 key = tb_board_key(b);
+    TBTable *table = tb_find(key);
+    if(!table || !tb_map(table, type)) {
+        *state = TB_FAIL;
+        return 0;
+    }
+    const TBFileMap *map = &table->maps[type];
+
+    // Tables are built with the stronger side as white. Otherwise, and for
+    // symmetric material with black to move, colors and ranks are flipped
+    bool flip = key != table->key || (table->key == table->key2 && b->side_to_move == COLOR_BLACK);
+    u32 flip_color = flip ? 8 : 0;
+    u32 flip_squares = flip ? 56 : 0;
+    u32 stm = flip ^ b->side_to_move;
+
+    u32 squares[TB_PIECES] = {0};
+    u8 pieces[TB_PIECES];
+    u32 size = 0;
+    u32 lead_count = 0;
+    u64 lead_pawns = 0;
+    u32 file = 0;
+
+    // Pawn tables are split by the file of the leading pawn, the pawn
+    // nearest the edge and then the lowest, which is encoded first
+    if(table->has_pawns) {
+        u8 piece = map->pairs[0].pieces[0] ^ flip_color;
+        lead_pawns = b->piece_bb[PAWN] & b->color_bb[piece >> 3];
+        u64 bb = lead_pawns;
+        while(bb) {
+            squares[size++] = pop_lsb(&bb) ^ flip_squares;
+        }
+        lead_count = size;
+        u32 lead = 0;
+        for(u32 i = 1; i < lead_count; i++) {
+            if(tb_map_pawns[squares[i]] > tb_map_pawns[squares[lead]]) {
+                lead = i;
+            }
+        }
+        u32 square = squares[0];
+        squares[0] = squares[lead];
+        squares[lead] = square;
+        file = MIN(SQUARE_X(squares[0]), 7 - SQUARE_X(squares[0]));
+    }
+
+    // DTZ tables hold one side to move only
+    if(type == TB_DTZ) {
+        const TBPairs *d = tb_pairs(table, map, type, 0, file);
+        if((d->flags & TB_FLAG_STM) != stm && !(table->key == table->key2 && !table->has_pawns)) {
+            *state = TB_CHANGE_STM;
+            return 0;
+        }
+    }
+
+    u64 bb = b->pieces_state ^ lead_pawns;
+    while(bb) {
+        u32 square = pop_lsb(&bb);
+        squares[size] = square ^ flip_squares;
+        pieces[size++] = (tb_piece_codes[b->pieces[square].type] + 8 * b->pieces[square].color) ^ flip_color;
+    }
+
+    // Order the pieces the way the table encodes them
+    const TBPairs *d = tb_pairs(table, map, type, stm, file);
+    for(u32 i = lead_count; i + 1 < size; i++) {
+        for(u32 j = i + 1; j < size; j++) {
+            if(d->pieces[i] == pieces[j]) {
+                u8 piece = pieces[i];
+                pieces[i] = pieces[j];
+                pieces[j] = piece;
+                u32 square = squares[i];
+                squares[i] = squares[j];
+                squares[j] = square;
+                break;
+            }
+        }
+    }
+
+    // The leading piece goes to the a-d files
+    if(SQUARE_X(squares[0]) > 3) {
+        for(u32 i = 0; i < size; i++) {
+            squares[i] ^= 7;
+        }
+    }
+
+    u64 index;
+    if(table->has_pawns) {
+        index = tb_lead_pawn_index[lead_count][squares[0]];
+        tb_sort_squares(squares + 1, lead_count - 1, true);
+        for(u32 i = 1; i < lead_count; i++) {
+            index += tb_binomial[i][tb_map_pawns[squares[i]]];
+        }
+    } else {
+        // Without pawns the leading piece also goes to ranks 1-4, and the
+        // first piece of the leading group off the a1-h8 diagonal below it
+        if(SQUARE_Y(squares[0]) > 3) {
+            for(u32 i = 0; i < size; i++) {
+                squares[i] ^= 56;
+            }
+        }
+        for(u32 i = 0; i < d->group_length[0]; i++) {
+            if(!tb_off_diagonal(squares[i])) {
+                continue;
+            }
+            if(tb_off_diagonal(squares[i]) > 0) {
+                for(u32 j = i; j < size; j++) {
+                    squares[j] = ((squares[j] >> 3) | (squares[j] << 3)) & 63;
+                }
+            }
+            break;
+        }
+
+        if(table->has_unique_pieces) {
+            // The first three pieces together: 6 triangle squares off the
+            // diagonal, then the cases with pieces on it
+            u64 s0 = squares[0];
+            u64 s1 = squares[1];
+            u64 s2 = squares[2];
+            u64 adjust1 = s1 > s0;
+            u64 adjust2 = (s2 > s0) + (s2 > s1);
+            if(tb_off_diagonal(s0)) {
+                index = (tb_map_a1d1d4[s0] * 63 + (s1 - adjust1)) * 62 + s2 - adjust2;
+            } else if(tb_off_diagonal(s1)) {
+                index = (6 * 63 + SQUARE_Y(s0) * 28 + tb_map_b1h1h7[s1]) * 62 + s2 - adjust2;
+            } else if(tb_off_diagonal(s2)) {
+                index = 6 * 63 * 62 + 4 * 28 * 62 + SQUARE_Y(s0) * 7 * 28
+                    + (SQUARE_Y(s1) - adjust1) * 28 + tb_map_b1h1h7[s2];
+            } else {
+                index = 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 + SQUARE_Y(s0) * 7 * 6
+                    + (SQUARE_Y(s1) - adjust1) * 6 + (SQUARE_Y(s2) - adjust2);
+            }
+        } else {
+            index = tb_map_kk[tb_map_a1d1d4[squares[0]]][squares[1]];
+        }
+    }
+    index *= d->group_index[0];
+
+    // Every further group by its squares in ascending order, skipping the
+    // squares taken by earlier groups. The other side's pawns come first
+    // and only use ranks 2-7
+    u32 *group = squares + d->group_length[0];
+    bool remaining_pawns = table->has_pawns && table->pawn_count[1];
+    for(u32 next = 1; d->group_length[next]; next++) {
+        u32 length = d->group_length[next];
+        tb_sort_squares(group, length, false);
+        u64 n = 0;
+        for(u32 i = 0; i < length; i++) {
+            u32 adjust = 0;
+            for(u32 *s = squares; s < group; s++) {
+                adjust += group[i] > *s;
+            }
+            n += tb_binomial[i + 1][group[i] - adjust - (remaining_pawns ? 8 : 0)];
+        }
+        remaining_pawns = false;
+        index += n * d->group_index[next];
+        group += length;
+    }
+
+    i32 value = tb_decompress(d, index);
+    return type == TB_WDL ? value - 2 : tb_dtz_value(map, d, value, wdl);
+}
+
+// Tables assume the best capture is not better than the stored value and
+// leave out positions with en passant, so captures are always searched.
+// With zeroing_moves pawn moves are searched as well, for DTZ probes
+static i32 tb_search(Board *b, bool zeroing_moves, i32 *state) {
+    Move moves[MAX_MOVES];
+    u32 count = generate_moves(b->side_to_move, moves, b);
+    u32 searched = 0;
+    i32 best = -2;
+    for(u32 i = 0; i < count; i++) {
+        Move move = moves[i];
+        if(!MOVE_IS_CAPTURE(move) && (!zeroing_moves || b->pieces[MOVE_FROM(move)].type != PAWN)) {
+            continue;
+        }
+        searched++;
+        Undo undo;
+        make_move(move, &undo, b);
+        i32 value = -tb_search(b, false, state);
+        unmake_move(move, &undo, b);
+        if(*state == TB_FAIL) {
+            return 0;
+        }
+        if(value > best) {
+            best = value;
+            if(value >= 2) {
+                *state = TB_ZEROING_BEST_MOVE;
+                return value;
+            }
+        }
+    }
+
+    // With every move searched the table is not needed, and may even be
+    // wrong, as for positions with en passant
+    bool all_searched = searched && searched == count;
+    i32 value = best;
+    if(!all_searched) {
+        value = tb_probe_table(b, TB_WDL, 0, state);
+        if(*state == TB_FAIL) {
+            return 0;
+        }
+    }
+    if(best >= value) {
+        *state = best > 0 || all_searched ? TB_ZEROING_BEST_MOVE : TB_OK;
+        return best;
+    }
+    *state = TB_OK;
+    return value;
+}
+
+// WDL of b for the side to move, see tb_probe_table. ok is cleared when b
+// is not covered by the tables found
+i32 tb_probe_wdl(Board *b, bool *ok) {
+    i32 state = TB_OK;
+    i32 wdl = tb_search(b, false, &state);
+    *ok = state != TB_FAIL;
+    return wdl;
+}
+
+static inline i32 tb_dtz_before_zeroing(i32 wdl) {
+    return wdl == 2 ? 1 : wdl == 1 ? 101 : wdl == -1 ? -101 : wdl == -2 ? -1 : 0;
+}
+
+static inline i32 tb_sign(i32 value) {
+    return (value > 0) - (value < 0);
+}
+
+// Plies to the next capture or pawn move with best play, positive when
+// the side to move wins and 100 more when the win or loss comes too late
+// for the fifty move rule. 0 for draws
+i32 tb_probe_dtz(Board *b, i32 *state) {
+    *state = TB_OK;
+    i32 wdl = tb_search(b, true, state);
+    if(*state == TB_FAIL || wdl == 0) {
+        return 0;
+    }
+    if(*state == TB_ZEROING_BEST_MOVE) {
+        return tb_dtz_before_zeroing(wdl);
+    }
+
+    i32 dtz = tb_probe_table(b, TB_DTZ, wdl, state);
+    if(*state == TB_FAIL) {
+        return 0;
+    }
+    if(*state != TB_CHANGE_STM) {
+        return (dtz + 100 * (wdl == -1 || wdl == 1)) * tb_sign(wdl);
+    }
+
+    // The table holds the other side to move: the best reply decides
+    Move moves[MAX_MOVES];
+    u32 count = generate_moves(b->side_to_move, moves, b);
+    i32 min_dtz = 0xFFFF;
+    for(u32 i = 0; i < count; i++) {
+        Move move = moves[i];
+        bool zeroing = MOVE_IS_CAPTURE(move) || b->pieces[MOVE_FROM(move)].type == PAWN;
+        Undo undo;
+        make_move(move, &undo, b);
+        // A zeroing move counts from before it, only its result matters
+        dtz = zeroing ? -tb_dtz_before_zeroing(tb_search(b, false, state)) : -tb_probe_dtz(b, state);
+        if(dtz == 1 && is_in_check(b->side_to_move, b)) {
+            Move replies[MAX_MOVES];
+            if(generate_moves(b->side_to_move, replies, b) == 0) {
+                min_dtz = 1;
+            }
+        }
+        if(!zeroing) {
+            dtz += tb_sign(dtz);
+        }
+        if(dtz < min_dtz && tb_sign(dtz) == tb_sign(wdl)) {
+            min_dtz = dtz;
+        }
+        unmake_move(move, &undo, b);
+        if(*state == TB_FAIL) {
+            return 0;
+        }
+    }
+    // No legal moves: mated
+    return min_dtz == 0xFFFF ? -1 : min_dtz;
+}
+
+// Picks the root move by DTZ: the fastest win that beats the fifty move
+// rule, otherwise a draw, otherwise the slowest loss. Returns false if the
+// tables do not cover the position. The score is from white's point of
+// view, like search scores
+bool tb_root_probe(Board *b, SearchResult *out) {
+    if(POPCOUNT(b->pieces_state) > tb.cardinality || b->castling_rights) {
+        return false;
+    }
+
+    Move moves[MAX_MOVES];
+    u32 count = generate_moves(b->side_to_move, moves, b);
+    i32 halfmoves = b->halfmove_clock;
+    i32 best_rank = INT_MIN;
+    i32 best_dtz = 0;
+    Move best_move = MOVE_NONE;
+    for(u32 i = 0; i < count; i++) {
+        Undo undo;
+        make_move(moves[i], &undo, b);
+        i32 state = TB_OK;
+        i32 dtz;
+        if(b->halfmove_clock == 0) {
+            bool ok;
+            dtz = tb_dtz_before_zeroing(-tb_probe_wdl(b, &ok));
+            state = ok ? TB_OK : TB_FAIL;
+        } else {
+            dtz = -tb_probe_dtz(b, &state);
+            dtz += tb_sign(dtz);
+        }
+        // Mating moves count as one ply
+        if(dtz == 2 && is_in_check(b->side_to_move, b)) {
+            Move replies[MAX_MOVES];
+            if(generate_moves(b->side_to_move, replies, b) == 0) {
+                dtz = 1;
+            }
+        }
+        unmake_move(moves[i], &undo, b);
+        if(state == TB_FAIL) {
+            return false;
+        }
+
+        // Wins in time all rank TB_MAX_DTZ. Wins the fifty move rule turns
+        // into draws rank in their own band below TB_MAX_DTZ / 2 - 100, by
+        // how close they come, still above real draws. Losses mirror this,
+        // blessed ones ranking above lost ones
+        i32 rank = 0;
+        if(dtz > 0) {
+            rank = dtz + halfmoves <= 99 ? TB_MAX_DTZ : TB_MAX_DTZ / 2 - (dtz + halfmoves);
+        } else if(dtz < 0) {
+            rank = -dtz * 2 + halfmoves < 100 ? -TB_MAX_DTZ : -TB_MAX_DTZ / 2 + (-dtz + halfmoves);
+        }
+        // Among equal ranks the shortest DTZ wins, so the game moves on
+        if(rank > best_rank || (rank == best_rank && dtz > 0 && dtz < best_dtz)) {
+            best_rank = rank;
+            best_dtz = dtz;
+            best_move = moves[i];
+        }
+    }
+    if(best_move == MOVE_NONE) {
+        return false;
+    }
+
+    // Cursed wins and blessed losses are draws, scored a little off zero so
+    // the side that was winning still prefers them, by at most half a pawn
+    i32 score = 0;
+    if(best_rank == TB_MAX_DTZ) {
+        score = TB_WIN_SCORE;
+    } else if(best_rank == -TB_MAX_DTZ) {
+        score = -TB_WIN_SCORE;
+    } else if(best_rank > 0) {
+        score = MAX(3, best_rank - (TB_MAX_DTZ / 2 - 200)) / 2;
+    } else if(best_rank < 0) {
+        score = MIN(-3, best_rank + (TB_MAX_DTZ / 2 - 200)) / 2;
+    }
+    out->move = best_move;
+    out->score = b->side_to_move == COLOR_WHITE ? score : -score;
+    out->depth = 1;
+    return true;
+}
+
+// Ordering scores. The hash move goes first, then captures and promotions
+// by MVV-LVA, then killers and finally quiet moves by history score, which
+// is capped below HISTORY_MAX
+#define ORDER_HASH_MOVE (1 << 30)
+#define ORDER_CAPTURE (1 << 28)
+#define ORDER_KILLER (1 << 27)
+#define HISTORY_MAX (1 << 20)
+
+// Helper threads add a little noise to quiet move scores so they explore
+// different subtrees from the main thread, rather than duplicating it
+#define HELPER_ORDER_NOISE 63
+
+// Piece values for MVV-LVA, indexed by PieceType. The king can never be
+// captured, as an attacker it sorts last
+static const i32 mvv_lva_value[PIECE_TYPE_COUNT] = {
+    [KING] = 100, [PAWN] = 1, [BISHOP] = 3, [KNIGHT] = 3, [ROOK] = 5, [QUEEN] = 9
+};
+
+void score_moves(SearchContext *ctx, const Board *b, const Move *moves, i32 *scores, u32 count, Move tt_move, i32 ply) {
+    for(u32 i = 0; i < count; i++) {
+        Move move = moves[i];
+        if(move == tt_move) {
+            scores[i] = ORDER_HASH_MOVE;
+        } else if(MOVE_IS_CAPTURE(move) || MOVE_IS_PROMOTION(move)) {
+            u32 flags = MOVE_FLAGS(move);
+            i32 victim = 0;
+            if(flags == FLAG_EN_PASSANT) {
+                victim = mvv_lva_value[PAWN];
+            } else if(flags & FLAG_CAPTURE) {
+                victim = mvv_lva_value[b->pieces[MOVE_TO(move)].type];
+            }
+            if(flags & FLAG_PROMOTION) {
+                victim += mvv_lva_value[MOVE_PROMOTION_TYPE(move)];
+            }
+            scores[i] = ORDER_CAPTURE + victim * 128 - mvv_lva_value[b->pieces[MOVE_FROM(move)].type];
+        } else if(move == ctx->killers[ply][0]) {
+            scores[i] = ORDER_KILLER + 1;
+        } else if(move == ctx->killers[ply][1]) {
+            scores[i] = ORDER_KILLER;
+        } else {
+            scores[i] = ctx->history[b->side_to_move][MOVE_FROM(move)][MOVE_TO(move)];
+            if(ctx->thread_id != 0) {
+                scores[i] += random_u64(&ctx->rng) & HELPER_ORDER_NOISE;
+            }
+        }
+    }
+}
+
+// Selection on demand: moves the best remaining move to index and returns
+// it. A cutoff usually comes early, so sorting the whole list is wasted
+static inline Move pick_move(Move *moves, i32 *scores, u32 count, u32 index) {
+    u32 best = index;
+    for(u32 i = index + 1; i < count; i++) {
+        if(scores[i] > scores[best]) {
+            best = i;
+        }
+    }
+
+    Move move = moves[best];
+    i32 score = scores[best];
+    moves[best] = moves[index];
+    scores[best] = scores[index];
+    moves[index] = move;
+    scores[index] = score;
+    return move;
+}
+
+void update_quiet_cutoff(SearchContext *ctx, u32 color, Move move, i32 depth, i32 ply) {
+    if(ctx->killers[ply][0] != move) {
+        ctx->killers[ply][1] = ctx->killers[ply][0];
+        ctx->killers[ply][0] = move;
+    }
+
+    i32 *entry = &ctx->history[color][MOVE_FROM(move)][MOVE_TO(move)];
+    *entry += depth * depth;
+    if(*entry >= HISTORY_MAX) {
+        // Halve the whole table, keeping relative order while letting
+        // newer cutoffs catch up
+        for(u32 from = 0; from < 64; from++) {
+            for(u32 to = 0; to < 64; to++) {
+                ctx->history[color][from][to] /= 2;
+            }
+        }
+    }
+}
+
+// Piece values for static exchange evaluation, indexed by PieceType
+static const i32 see_value[PIECE_TYPE_COUNT] = {
+    [KING] = 20000, [PAWN] = 100, [BISHOP] = 300, [KNIGHT] = 300, [ROOK] = 500, [QUEEN] = 900
+};
+
+// Static exchange evaluation: the material the side making move wins once
+// every capture on the destination square has been played out, least
+// valuable attacker first, with either side free to stop when continuing
+// would lose material. Sliders behind the capturers join in as x-rays
+i32 see(const Board *b, Move move) {
+    u32 from = MOVE_FROM(move);
+    u32 to = MOVE_TO(move);
+    u32 flags = MOVE_FLAGS(move);
+    u64 occupied = b->pieces_state;
+    u64 bishops = b->piece_bb[BISHOP] | b->piece_bb[QUEEN];
+    u64 rooks = b->piece_bb[ROOK] | b->piece_bb[QUEEN];
+
+    i32 gain[32];
+    PieceType on_square = b->pieces[from].type;
+    u32 side = b->pieces[from].color;
+
+    gain[0] = 0;
+    if(flags == FLAG_EN_PASSANT) {
+        gain[0] = see_value[PAWN];
+        occupied ^= SQUARE_BIT(to ^ 8);
+    } else if(flags & FLAG_CAPTURE) {
+        gain[0] = see_value[b->pieces[to].type];
+    }
+    if(flags & FLAG_PROMOTION) {
+        on_square = MOVE_PROMOTION_TYPE(move);
+        gain[0] += see_value[on_square] - see_value[PAWN];
+    }
+
+    static const PieceType capture_order[PIECE_TYPE_COUNT] = {PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING};
+    u64 attackers = attackers_to(to, occupied, b) & occupied;
+    u64 from_bit = SQUARE_BIT(from);
+    i32 depth = 0;
+    do {
+        depth++;
+        // Score if the other side now takes the piece that just captured
+        gain[depth] = see_value[on_square] - gain[depth - 1];
+        if(MAX(-gain[depth - 1], gain[depth]) < 0) {
+            break;
+        }
+
+        occupied ^= from_bit;
+        attackers |= (bishop_attacks(to, occupied) & bishops) | (rook_attacks(to, occupied) & rooks);
+        attackers &= occupied;
+        side ^= 1;
+
+        from_bit = 0;
+        for(u32 i = 0; i < PIECE_TYPE_COUNT; i++) {
+            u64 candidates = attackers & b->color_bb[side] & b->piece_bb[capture_order[i]];
+            if(candidates) {
+                from_bit = candidates & -candidates;
+                on_square = capture_order[i];
+                break;
+            }
+        }
+    } while(from_bit && depth < 31);
+
+    while(--depth) {
+        gain[depth - 1] = -MAX(-gain[depth - 1], gain[depth]);
+    }
+    return gain[0];
+}
+
+// Quiet checks at the first quiescence ply, off by default
+bool qsearch_checks = false;
+
+// Quiet move check for qsearch_checks, by playing the move out
+bool gives_check(Move move, Board *b) {
+    Undo undo;
+    make_move(move, &undo, b);
+    bool check = is_in_check(b->side_to_move, b);
+    unmake_move(move, &undo, b);
+    return check;
+}
+
+// Resolves captures below the nominal depth so the static evaluation is
+// never taken in the middle of an exchange. The side to move can stand pat
+// on the static evaluation unless it is in check, in which case every
+// evasion is searched. Captures that lose material by SEE are skipped
+i32 quiescence(SearchContext *ctx, Board *b, i32 ply_from_root, i32 qply, i32 alpha, i32 beta, i32 who_to_move) {
+    ctx->nodes++;
+    STAT(ctx->stats.nodes_by_ply[ply_from_root]++);
+    STAT(ctx->stats.qnodes++);
+    check_limits(ctx);
+    if(ctx->stopped) {
+        return 0;
+    }
+
+    bool in_check = is_in_check(who_to_move, b);
+    i32 best_eval = who_to_move == COLOR_WHITE ? INT_MIN : INT_MAX;
+    if(!in_check) {
+        best_eval = evaluate_board(b);
+        if(ply_from_root >= MAX_PLY) {
+            return best_eval;
+        }
+        if(who_to_move == COLOR_WHITE) {
+            if(best_eval >= beta) {
+                return best_eval;
+            }
+            alpha = MAX(alpha, best_eval);
+        } else {
+            if(best_eval <= alpha) {
+                return best_eval;
+            }
+            beta = MIN(beta, best_eval);
+        }
+    } else if(ply_from_root >= MAX_PLY) {
+        return evaluate_board(b);
+    }
+
+    Move *moves = ctx->move_stack[ply_from_root];
+    u32 move_count = in_check ? generate_moves(who_to_move, moves, b) : generate_captures(who_to_move, moves, b);
+    if(in_check && move_count == 0) {
+        return who_to_move == COLOR_WHITE ? -(MATE_SCORE - ply_from_root) : MATE_SCORE - ply_from_root;
+    }
+
+    // Optionally add quiet checks at the first quiescence ply. They go after
+    // the captures, which score_moves ranks higher anyway
+    if(qsearch_checks && qply == 0 && !in_check) {
+        Move quiet[MAX_MOVES];
+        u32 quiet_count = generate_moves(who_to_move, quiet, b);
+        for(u32 i = 0; i < quiet_count; i++) {
+            if(!MOVE_IS_CAPTURE(quiet[i]) && !MOVE_IS_PROMOTION(quiet[i]) && gives_check(quiet[i], b)) {
+                moves[move_count] = quiet[i];
+                move_count++;
+            }
+        }
+    }
+
+    i32 move_scores[MAX_MOVES];
+    score_moves(ctx, b, moves, move_scores, move_count, MOVE_NONE, ply_from_root);
+
+    Undo undo;
+    for(u32 i = 0; i < move_count; i++) {
+        Move move = pick_move(moves, move_scores, move_count, i);
+        if(!in_check && MOVE_IS_CAPTURE(move) && see(b, move) < 0) {
+            continue;
+        }
+
+        make_move(move, &undo, b);
+        i32 eval = quiescence(ctx, b, ply_from_root + 1, qply + 1, alpha, beta, who_to_move ^ 1);
+        unmake_move(move, &undo, b);
+        if(ctx->stopped) {
+            return 0;
+        }
+
+        if(who_to_move == COLOR_WHITE) {
+            best_eval = MAX(best_eval, eval);
+            alpha = MAX(alpha, eval);
+            if(eval >= beta) {
+                break;
+            }
+        } else {
+            best_eval = MIN(best_eval, eval);
+            beta = MIN(beta, eval);
+            if(eval <= alpha) {
+                break;
+            }
+        }
+    }
+
+    return best_eval;
+}
+
+i32 minimax(SearchContext *ctx, Board *b, i32 depth, i32 ply_from_root, i32 alpha, i32 beta, i32 who_to_move) {
+    if(depth == 0 || ply_from_root >= MAX_PLY) {
+        return quiescence(ctx, b, ply_from_root, 0, alpha, beta, who_to_move);
+    }
+
+    ctx->nodes++;
+    STAT(ctx->stats.nodes_by_ply[ply_from_root]++);
+    check_limits(ctx);
+    if(ctx->stopped) {
+        return 0;
+    }
+
+    i32 alpha_original = alpha;
+    i32 beta_original = beta;
+
+    // Positions already searched at least this deep can be answered from the
+    // table. The root always searches, since it has to produce best_move
+    TTData tt_data;
+    Move tt_move = MOVE_NONE;
+    ctx->tt_probes++;
+    if(tt_probe(b->hash, &tt_data)) {
+        ctx->tt_hits++;
+        tt_move = tt_data.move;
+        i32 tt_score = score_from_tt(tt_data.score, ply_from_root);
+        if(ply_from_root > 0 && tt_data.depth >= depth) {
+            if(tt_data.bound == BOUND_EXACT
+                || (tt_data.bound == BOUND_LOWER && tt_score >= beta)
+                || (tt_data.bound == BOUND_UPPER && tt_score <= alpha)) {
+                return tt_score;
+            }
+        }
+    }
+
+    // Endgames in the tablebases are answered from them, once castling is
+    // gone and a capture or pawn move has just reset the fifty move count,
+    // as the tables assume. With exactly probe_limit pieces only searches
+    // deep enough to be worth the probe ask
+    u32 piece_count = POPCOUNT(b->pieces_state);
+    if(ply_from_root > 0 && piece_count <= tb.cardinality
+        && (piece_count < tb.cardinality || depth >= (i32)tb.probe_depth)
+        && b->halfmove_clock == 0 && !b->castling_rights) {
+        bool ok;
+        i32 wdl = tb_probe_wdl(b, &ok);
+        if(ok) {
+            atomic_fetch_add_explicit(&ctx->shared->tb_hits, 1, memory_order_relaxed);
+            // Wins and losses the fifty move rule spoils are draws
+            i32 score = wdl > 1 ? TB_WIN_SCORE : wdl < -1 ? -TB_WIN_SCORE : 0;
+            score = who_to_move == COLOR_WHITE ? score : -score;
+            tt_store(b->hash, MOVE_NONE, score, MIN(depth + 6, MAX_PLY - 1), BOUND_EXACT);
+            return score;
+        }
+    }
+
+    // The previous iteration's best move leads the root, even if its table
+    // entry has been replaced since
+    if(ply_from_root == 0 && ctx->root_best_move != MOVE_NONE) {
+        tt_move = ctx->root_best_move;
+    }
+
+    Move *minimax_moves = ctx->move_stack[ply_from_root];
+    u32 move_count = generate_moves(who_to_move, minimax_moves, b);
+
+    i32 move_scores[MAX_MOVES];
+    score_moves(ctx, b, minimax_moves, move_scores, move_count, tt_move, ply_from_root);
+
+    if(move_count == 0) {
+        if(is_in_check(who_to_move, b)) {
+            return who_to_move == COLOR_WHITE ? -(MATE_SCORE - ply_from_root) : MATE_SCORE - ply_from_root;
+        }
+        return 0;
+    }
+    STAT(ctx->stats.expanded_nodes++);
+
+    Undo undo;
+    Move node_best_move = MOVE_NONE;
+    if(who_to_move == COLOR_WHITE) {
+        i32 max_eval = INT_MIN;
+        for(u32 i = 0; i < move_count; i++) {
+            Move move = pick_move(minimax_moves, move_scores, move_count, i);
+            make_move(move, &undo, b);
+            i32 eval = minimax(ctx, b, depth - 1, ply_from_root + 1, alpha, beta, COLOR_BLACK);
+            unmake_move(move, &undo, b);
+            if(ctx->stopped) {
+                return 0;
+            }
+            if(eval > max_eval) {
+                node_best_move = move;
+                if(ply_from_root == 0) {
+                    ctx->root_best_move = move;
+                }
+            }
+            max_eval = MAX(max_eval, eval);
+            alpha = MAX(alpha, eval);
+            if(eval >= beta) {
+                STAT(ctx->stats.beta_cutoffs++);
+                STAT(ctx->stats.first_move_cutoffs += i == 0);
+                if(!MOVE_IS_CAPTURE(move) && !MOVE_IS_PROMOTION(move)) {
+                    update_quiet_cutoff(ctx, who_to_move, move, depth, ply_from_root);
+                }
+                break;
+            }
+        }
+
+        u32 bound = max_eval >= beta_original ? BOUND_LOWER : max_eval <= alpha_original ? BOUND_UPPER : BOUND_EXACT;
+        tt_store(b->hash, bound == BOUND_UPPER ? MOVE_NONE : node_best_move,
+            score_to_tt(max_eval, ply_from_root), depth, bound);
+        return max_eval;
+    } else {
+        i32 min_eval = INT_MAX;
+        for(u32 i = 0; i < move_count; i++) {
+            Move move = pick_move(minimax_moves, move_scores, move_count, i);
+            make_move(move, &undo, b);
+            i32 eval = minimax(ctx, b, depth - 1, ply_from_root + 1, alpha, beta, COLOR_WHITE);
+            unmake_move(move, &undo, b);
+            if(ctx->stopped) {
+                return 0;
+            }
+            if(eval < min_eval) {
+                node_best_move = move;
+                if(ply_from_root == 0) {
+                    ctx->root_best_move = move;
+                }
+            }
+            min_eval = MIN(min_eval, eval);
+            beta = MIN(beta, eval);
+            if(eval <= alpha) {
+                STAT(ctx->stats.beta_cutoffs++);
+                STAT(ctx->stats.first_move_cutoffs += i == 0);
+                if(!MOVE_IS_CAPTURE(move) && !MOVE_IS_PROMOTION(move)) {
+                    update_quiet_cutoff(ctx, who_to_move, move, depth, ply_from_root);
+                }
+                break;
+            }
+        }
+
+        // Bounds are from white's point of view, so a fail low here is still
+        // an upper bound on the score
+        u32 bound = min_eval <= alpha_original ? BOUND_UPPER : min_eval >= beta_original ? BOUND_LOWER : BOUND_EXACT;
+        tt_store(b->hash, bound == BOUND_LOWER ? MOVE_NONE : node_best_move,
+            score_to_tt(min_eval, ply_from_root), depth, bound);
+        return min_eval;
+    }
+}
+
+// Follows hash moves from b to rebuild the principal variation. Entries can
+// be overwritten by then, so each move is checked for legality and the walk
+// stops at the first gap
+u32 extract_pv(const Board *b, Move first, Move *pv, u32 max_length) {
+    Board board;
+    memcpy(&board, b, sizeof(board));
+
+    Move moves[MAX_MOVES];
+    u32 length = 0;
+    Move move = first;
+    while(move != MOVE_NONE && length < max_length) {
+        u32 count = generate_moves(board.side_to_move, moves, &board);
+        bool legal = false;
+        for(u32 i = 0; i < count; i++) {
+            legal |= moves[i] == move;
+        }
+        if(!legal) {
+            break;
+        }
+
+        pv[length++] = move;
+        Undo undo;
+        make_move(move, &undo, &board);
+        TTData data;
+        move = tt_probe(board.hash, &data) ? data.move : MOVE_NONE;
+    }
+    return length;
+}
+
+// Formats a search score the way UCI does: from the side to move's point
+// of view, as "cp <centipawns>" or "mate <moves>", negative when mated
+i32 format_score(i32 score, u32 side_to_move, char *out, size_t size) {
+    if(side_to_move == COLOR_BLACK) {
+        score = -score;
+    }
+    if(abs(score) >= MATE_BOUND) {
+        i32 moves = (MATE_SCORE - abs(score) + 1) / 2;
+        return snprintf(out, size, "mate %d", score > 0 ? moves : -moves);
+    }
+    return snprintf(out, size, "cp %d", score);
+}
+
+// UCI info line for a finished iteration
+void report_iteration(const SearchContext *ctx, const SearchResult *result) {
+    SearchShared *shared = ctx->shared;
+    u64 elapsed = now_ms() - shared->go_ms;
+    // Threads publish their counts every LIMIT_CHECK_INTERVAL nodes, so add
+    // the part this thread has not published yet
+    u64 nodes = atomic_load(&shared->nodes) + ctx->nodes % LIMIT_CHECK_INTERVAL;
+    u64 tb_hits = atomic_load(&shared->tb_hits);
+
+    char line[160 + MAX_PLY * 6];
+    i32 length = snprintf(line, sizeof(line), "info depth %d score ", result->depth);
+    length += format_score(result->score, ctx->board.side_to_move, line + length, sizeof(line) - length);
+    length += snprintf(line + length, sizeof(line) - length, " nodes %llu nps %llu tbhits %llu time %llu hashfull %u pv",
+        (unsigned long long)nodes, (unsigned long long)(nodes * 1000 / MAX(elapsed, 1)),
+        (unsigned long long)tb_hits, (unsigned long long)elapsed, tt_hashfull());
+
+    Move pv[MAX_PLY];
+    u32 pv_length = extract_pv(&ctx->board, result->move, pv, result->depth);
+    for(u32 i = 0; i < pv_length; i++) {
+        line[length++] = ' ';
+        move_to_string(pv[i], line + length);
+        length += strlen(line + length);
+    }
+
+    // One write per line, so lines from different threads never interleave
+    printf("%s\n", line);
+    fflush(stdout);
+}
+
+// Helper threads skip some depths so that at any moment the threads are
+// spread over neighbouring iterations instead of all racing on the same
+// one. Thread i uses row (i - 1) % 20: it searches a depth unless it falls
+// inside the skipped part of a cycle of length 2 * size
+static const i32 skip_size[20] = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+static const i32 skip_phase[20] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+static inline bool skip_depth(u32 thread_id, i32 depth) {
+    if(thread_id == 0) {
+        return false;
+    }
+    u32 row = (thread_id - 1) % 20;
+    return ((depth + skip_phase[row]) / skip_size[row]) % 2 != 0;
+}
+
+// Iterative deepening: searches depth 1, 2, ... on the thread's own board
+// until a limit runs out and returns the result of the last iteration that
+// finished. Each iteration leaves its best moves in the transposition table
+// and root_best_move, which order the next one
+SearchResult search(SearchContext *ctx) {
+    SearchShared *shared = ctx->shared;
+    Board *b = &ctx->board;
+    SearchResult result = {.move = MOVE_NONE, .score = 0, .depth = 0};
+    i32 max_depth = shared->limits.depth > 0 ? MIN(shared->limits.depth, MAX_PLY) : MAX_PLY;
+
+    ctx->stopped = false;
+    ctx->root_best_move = MOVE_NONE;
+    ctx->nodes = 0;
+    STAT(memset(&ctx->stats, 0, sizeof(ctx->stats)));
+
+    // Killers are tied to plies of the previous game position, history is
+    // still useful but is aged so the new position can reshape it
+    memset(ctx->killers, 0, sizeof(ctx->killers));
+    for(u32 color = 0; color < 2; color++) {
+        for(u32 from = 0; from < 64; from++) {
+            for(u32 to = 0; to < 64; to++) {
+                ctx->history[color][from][to] /= 8;
+            }
+        }
+    }
+
+    // The network may have been switched on since the position was set up
+    if(nnue.enabled) {
+        nnue_refresh(b);
+    }
+
+    // Tablebase positions are played by DTZ without searching
+    if(tb_root_probe(b, &result)) {
+        atomic_fetch_add_explicit(&shared->tb_hits, 1, memory_order_relaxed);
+        if(ctx->thread_id == 0 && shared->report) {
+            report_iteration(ctx, &result);
+        }
+        return result;
+    }
+
+    // Played if the search is stopped before any root move is finished
+    Move root_moves[MAX_MOVES];
+    Move fallback_move = generate_moves(b->side_to_move, root_moves, b) ? root_moves[0] : MOVE_NONE;
+
+    for(i32 depth = 1; depth <= max_depth; depth++) {
+        // The last depth is never skipped, or a helper could finish early
+        // without ever searching it
+        if(depth < max_depth && skip_depth(ctx->thread_id, depth)) {
+            continue;
+        }
+
+        i32 score = minimax(ctx, b, depth, 0, INT_MIN, INT_MAX, b->side_to_move);
+        if(ctx->stopped) {
+            // Even a partial first iteration beats returning no move
+            if(result.move == MOVE_NONE) {
+                result.move = ctx->root_best_move != MOVE_NONE ? ctx->root_best_move : fallback_move;
+            }
+            break;
+        }
+
+        result.move = ctx->root_best_move;
+        result.score = score;
+        result.depth = depth;
+#ifdef SEARCH_STATS
+        SearchIteration *iteration = &ctx->stats.iterations[ctx->stats.iteration_count++];
+        iteration->depth = depth;
+        iteration->nodes = ctx->nodes;
+        iteration->time_ms = now_ms() - shared->go_ms;
+#endif
+        if(ctx->thread_id == 0 && shared->report) {
+            report_iteration(ctx, &result);
+        }
+
+        // No legal moves, or a forced mate already found
+        if(result.move == MOVE_NONE || abs(score) >= MATE_BOUND) {
+            break;
+        }
+
+        // The next iteration costs more than all previous ones together, so
+        // past half the budget it would almost certainly be thrown away
+        if(ctx->thread_id == 0 && shared->limits.time_ms
+            && search_elapsed_ms(shared) > shared->limits.time_ms / 2) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+// Lazy SMP: every thread searches the same root with its own board, move
+// stack, killers and history. They cooperate only through the shared
+// transposition table, where each one picks up the others' results
+typedef struct {
+    u32 count;
+    SearchContext **contexts;
+    pthread_t *handles;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+
+    // Bumped for every search, each thread runs once per value
+    u64 search_id;
+    // Threads still searching
+    u32 active;
+    bool quit;
+
+    SearchShared shared;
+} ThreadPool;
+
+ThreadPool pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+void *thread_main(void *arg) {
+    SearchContext *ctx = arg;
+    u64 seen_id = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+    for(;;) {
+        while(!pool.quit && pool.search_id == seen_id) {
+            pthread_cond_wait(&pool.wake, &pool.mutex);
+        }
+        if(pool.quit) {
+            break;
+        }
+        seen_id = pool.search_id;
+        pthread_mutex_unlock(&pool.mutex);
+
+        ctx->result = search(ctx);
+        // The main thread decides when the search is over, helpers are
+        // stopped as soon as it returns
+        if(ctx->thread_id == 0) {
+            atomic_store(&pool.shared.stop, true);
+        }
+
+        pthread_mutex_lock(&pool.mutex);
+        if(--pool.active == 0) {
+            pthread_cond_broadcast(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    return NULL;
+}
+
+void threads_stop(void) {
+    atomic_store(&pool.shared.stop, true);
+}
+
+// The opponent played the expected move: the search carries on, now
+// against the clock
+void threads_ponderhit(void) {
+    atomic_store(&pool.shared.start_ms, now_ms());
+    atomic_store(&pool.shared.ponder, false);
+}
+
+// Waits for the running search, if any, and merges the thread results:
+// the deepest completed iteration wins, and among equally deep ones the
+// best score for the side to move
+SearchResult threads_wait(void) {
+    pthread_mutex_lock(&pool.mutex);
+    while(pool.active > 0) {
+        pthread_cond_wait(&pool.done, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    SearchResult best = pool.contexts[0]->result;
+    u32 color = pool.contexts[0]->board.side_to_move;
+    for(u32 i = 1; i < pool.count; i++) {
+        SearchResult result = pool.contexts[i]->result;
+        if(result.move == MOVE_NONE || result.depth < best.depth) {
+            continue;
+        }
+        bool better = color == COLOR_WHITE ? result.score > best.score : result.score < best.score;
+        if(result.depth > best.depth || better) {
+            best = result;
+        }
+    }
+    return best;
+}
+
+// Starts a search of b on every thread and returns at once. With ponder
+// the time limit is held until threads_ponderhit
+void threads_start(const Board *b, const SearchLimits *limits, bool ponder) {
+    threads_wait();
+
+    pool.shared.limits = *limits;
+    pool.shared.go_ms = now_ms();
+    atomic_store(&pool.shared.start_ms, pool.shared.go_ms);
+    atomic_store(&pool.shared.ponder, ponder);
+    atomic_store(&pool.shared.stop, false);
+    atomic_store(&pool.shared.nodes, 0);
+    atomic_store(&pool.shared.tb_hits, 0);
+    for(u32 i = 0; i < pool.count; i++) {
+        SearchContext *ctx = pool.contexts[i];
+        memcpy(&ctx->board, b, sizeof(*b));
+        ctx->result = (SearchResult){.move = MOVE_NONE, .score = 0, .depth = 0};
+        ctx->tt_probes = 0;
+        ctx->tt_hits = 0;
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.active = pool.count;
+    pool.search_id++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void threads_free(void) {
+    if(pool.count == 0) {
+        return;
+    }
+    threads_stop();
+    threads_wait();
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for(u32 i = 0; i < pool.count; i++) {
+        pthread_join(pool.handles[i], NULL);
+        free(pool.contexts[i]);
+    }
+    free(pool.contexts);
+    free(pool.handles);
+    pool.contexts = NULL;
+    pool.handles = NULL;
+    pool.count = 0;
+    pool.quit = false;
+    // New threads start from search_id 0
+    pool.search_id = 0;
+}
+
+// Replaces the pool with count idle threads, each with fresh tables
+void threads_resize(u32 count) {
+    threads_free();
+
+    count = MAX(count, 1);
+    pool.contexts = engine_alloc(_Alignof(SearchContext *), count * sizeof(SearchContext *));
+    pool.handles = engine_alloc(_Alignof(pthread_t), count * sizeof(pthread_t));
+    for(u32 i = 0; i < count; i++) {
+        SearchContext *ctx = engine_alloc(_Alignof(SearchContext), sizeof(SearchContext));
+        memset(ctx, 0, sizeof(*ctx));
+        ctx->shared = &pool.shared;
+        ctx->thread_id = i;
+        ctx->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        pool.contexts[i] = ctx;
+    }
+    pool.count = count;
+    for(u32 i = 0; i < count; i++) {
+        if(pthread_create(&pool.handles[i], NULL, thread_main, pool.contexts[i]) != 0) {
+            fprintf(stderr, "Failed to start search thread %u\n", i);
+            exit(1);
+        }
+    }
+}
+
+// Forgets everything learned from earlier searches, so the next search
+// depends only on its position and limits
+void threads_clear(void) {
+    threads_wait();
+    for(u32 i = 0; i < pool.count; i++) {
+        memset(pool.contexts[i]->killers, 0, sizeof(pool.contexts[i]->killers));
+        memset(pool.contexts[i]->history, 0, sizeof(pool.contexts[i]->history));
+    }
+}
+
+u64 threads_nodes(void) {
+    u64 nodes = 0;
+    for(u32 i = 0; i < pool.count; i++) {
+        nodes += pool.contexts[i]->nodes;
+    }
+    return nodes;
+}
+
+#ifdef SEARCH_STATS
+// Print the statistics of every search, as JSON
+bool show_stats = false;
+
+// Sums the counters of every thread from the last search. Iterations are
+// the main thread's, helpers skip depths
+void threads_stats(SearchStats *out) {
+    memset(out, 0, sizeof(*out));
+    for(u32 i = 0; i < pool.count; i++) {
+        const SearchStats *stats = &pool.contexts[i]->stats;
+        for(u32 ply = 0; ply <= MAX_PLY; ply++) {
+            out->nodes_by_ply[ply] += stats->nodes_by_ply[ply];
+        }
+        out->qnodes += stats->qnodes;
+        out->expanded_nodes += stats->expanded_nodes;
+        out->beta_cutoffs += stats->beta_cutoffs;
+        out->first_move_cutoffs += stats->first_move_cutoffs;
+        out->tt_probes += pool.contexts[i]->tt_probes;
+        out->tt_hits += pool.contexts[i]->tt_hits;
+    }
+    if(pool.count) {
+        const SearchStats *main_stats = &pool.contexts[0]->stats;
+        memcpy(out->iterations, main_stats->iterations, sizeof(out->iterations));
+        out->iteration_count = main_stats->iteration_count;
+    }
+}
+
+static inline f64 stats_ratio(u64 part, u64 whole) {
+    return whole ? (f64)part / (f64)whole : 0.0;
+}
+
+// The n-th root of value, by bisection so the build needs no libm
+static f64 stats_root(u64 value, i32 n) {
+    if(!value) {
+        return 0.0;
+    }
+    f64 low = 1.0;
+    f64 high = (f64)value;
+    for(u32 i = 0; i < 64; i++) {
+        f64 middle = (low + high) / 2;
+        f64 power = 1.0;
+        for(i32 j = 0; j < n && power <= (f64)value; j++) {
+            power *= middle;
+        }
+        if(power > (f64)value) {
+            high = middle;
+        } else {
+            low = middle;
+        }
+    }
+    return low;
+}
+
+// Writes stats as one line of JSON after prefix. The effective branching
+// factor of an iteration is its node count over the previous one's. The
+// overall one is the depth-th root of the last iteration's nodes, which a
+// warm transposition table does not skew as much
+void print_search_stats(const char *prefix, const SearchStats *stats) {
+    u64 nodes = 0;
+    u32 plies = 0;
+    for(u32 ply = 0; ply <= MAX_PLY; ply++) {
+        nodes += stats->nodes_by_ply[ply];
+        if(stats->nodes_by_ply[ply]) {
+            plies = ply + 1;
+        }
+    }
+
+    f64 ebf[MAX_PLY] = {0};
+    for(u32 i = 1; i < stats->iteration_count; i++) {
+        u64 previous = stats->iterations[i - 1].nodes - (i > 1 ? stats->iterations[i - 2].nodes : 0);
+        ebf[i] = stats_ratio(stats->iterations[i].nodes - stats->iterations[i - 1].nodes, previous);
+    }
+
+    f64 overall_ebf = 0.0;
+    if(stats->iteration_count) {
+        const SearchIteration *last = &stats->iterations[stats->iteration_count - 1];
+        u64 last_nodes = last->nodes - (stats->iteration_count > 1 ? last[-1].nodes : 0);
+        overall_ebf = stats_root(last_nodes, last->depth);
+    }
+
+    // Other threads may be printing info lines
+    flockfile(stdout);
+    printf("%s{\"nodes\":%llu,\"qnodes\":%llu,\"tt_probes\":%llu,\"tt_hits\":%llu,\"tt_hit_rate\":%.4f,"
+        "\"beta_cutoffs\":%llu,\"cutoff_rate\":%.4f,\"first_move_cutoff_rate\":%.4f,\"ebf\":%.2f,\"nodes_by_ply\":[",
+        prefix, (unsigned long long)nodes, (unsigned long long)stats->qnodes,
+        (unsigned long long)stats->tt_probes, (unsigned long long)stats->tt_hits,
+        stats_ratio(stats->tt_hits, stats->tt_probes), (unsigned long long)stats->beta_cutoffs,
+        stats_ratio(stats->beta_cutoffs, stats->expanded_nodes),
+        stats_ratio(stats->first_move_cutoffs, stats->beta_cutoffs),
+        overall_ebf);
+    for(u32 ply = 0; ply < plies; ply++) {
+        printf("%s%llu", ply ? "," : "", (unsigned long long)stats->nodes_by_ply[ply]);
+    }
+    printf("],\"iterations\":[");
+    for(u32 i = 0; i < stats->iteration_count; i++) {
+        const SearchIteration *iteration = &stats->iterations[i];
+        printf("%s{\"depth\":%d,\"nodes\":%llu,\"time_ms\":%llu,\"ebf\":%.2f}", i ? "," : "",
+            iteration->depth, (unsigned long long)(iteration->nodes - (i ? stats->iterations[i - 1].nodes : 0)),
+            (unsigned long long)(iteration->time_ms - (i ? stats->iterations[i - 1].time_ms : 0)), ebf[i]);
+    }
+    printf("]}\n");
+    fflush(stdout);
+    funlockfile(stdout);
+}
+#endif
+
+// Perft counts the leaves of the legal move tree, which pins down move
+// generation against published numbers and measures its raw speed. The
+// last ply is bulk counted: the number of legal moves is the number of
+// leaves, so those positions are never made
+typedef struct {
+    _Atomic u64 key;
+    _Atomic u64 data;
+} PerftEntry;
+
+// Optional transposition table for perft. Counts are exact, so an entry
+// answers any later visit to the same position at the same depth. The
+// data word packs the count in the low 56 bits and the depth in the top 8,
+// and the key is XORed with it like in the search table
+typedef struct {
+    PerftEntry *entries;
+    u64 entry_count;
+} PerftTable;
+
+static inline PerftEntry *perft_entry(const PerftTable *table, u64 hash) {
+    __extension__ typedef unsigned __int128 u128;
+    return &table->entries[(u64)(((u128)hash * table->entry_count) >> 64)];
+}
+
+u64 perft(Board *b, i32 depth, i32 ply, Move (*move_stack)[MAX_MOVES], const PerftTable *table) {
+    if(depth == 0) {
+        return 1;
+    }
+
+    // Bulk counted plies are cheaper to generate than to look up, deeper
+    // ones are probed before paying for move generation
+    PerftEntry *entry = NULL;
+    if(table && depth > 1) {
+        entry = perft_entry(table, b->hash);
+        u64 data = atomic_load_explicit(&entry->data, memory_order_relaxed);
+        u64 key = atomic_load_explicit(&entry->key, memory_order_relaxed);
+        if((key ^ data) == b->hash && (i32)(data >> 56) == depth) {
+            return data & 0x00FFFFFFFFFFFFFFull;
+        }
+    }
+
+    Move *moves = move_stack[ply];
+    u32 count = generate_moves(b->side_to_move, moves, b);
+    if(depth == 1) {
+        return count;
+    }
+
+    u64 nodes = 0;
+    for(u32 i = 0; i < count; i++) {
+        Undo undo;
+        make_move(moves[i], &undo, b);
+        nodes += perft(b, depth - 1, ply + 1, move_stack, table);
+        unmake_move(moves[i], &undo, b);
+    }
+
+    if(entry) {
+        u64 data = ((u64)depth << 56) | (nodes & 0x00FFFFFFFFFFFFFFull);
+        atomic_store_explicit(&entry->key, b->hash ^ data, memory_order_relaxed);
+        atomic_store_explicit(&entry->data, data, memory_order_relaxed);
+    }
+    return nodes;
+}
+
+// Root moves are handed out one at a time from a shared index, so threads
+// that draw small subtrees simply take more of them
+typedef struct {
+    const Board *root;
+    const Move *root_moves;
+    u32 root_count;
+    u64 *root_nodes;
+    _Atomic u32 next_root;
+    i32 depth;
+    const PerftTable *table;
+} PerftJob;
+
+typedef struct {
+    _Alignas(64) Move move_stack[MAX_PLY][MAX_MOVES];
+    Board board;
+    PerftJob *job;
+} PerftWorker;
+
+void *perft_worker_main(void *arg) {
+    PerftWorker *worker = arg;
+    PerftJob *job = worker->job;
+    for(;;) {
+        u32 index = atomic_fetch_add(&job->next_root, 1);
+        if(index >= job->root_count) {
+            break;
+        }
+        memcpy(&worker->board, job->root, sizeof(Board));
+        Undo undo;
+        make_move(job->root_moves[index], &undo, &worker->board);
+        job->root_nodes[index] = perft(&worker->board, job->depth - 1, 0, worker->move_stack, job->table);
+    }
+    return NULL;
+}
+
+// Runs perft to depth on thread_count threads and prints the leaf count
+// below every root move (divide), the total and the speed. hash_mb of 0
+// disables the transposition table
+u64 perft_divide(const Board *b, i32 depth, u32 thread_count, u64 hash_mb) {
+    Move root_moves[MAX_MOVES];
+    u64 root_nodes[MAX_MOVES] = {0};
+    Board root;
+    memcpy(&root, b, sizeof(root));
+    u32 root_count = generate_moves(root.side_to_move, root_moves, &root);
+
+    PerftTable table = {0};
+    if(hash_mb) {
+        table.entry_count = hash_mb * 1024 * 1024 / sizeof(PerftEntry);
+        table.entries = engine_alloc(64, table.entry_count * sizeof(PerftEntry));
+        memset(table.entries, 0, table.entry_count * sizeof(PerftEntry));
+    }
+
+    PerftJob job = {
+        .root = &root,
+        .root_moves = root_moves,
+        .root_count = depth > 0 ? root_count : 0,
+        .root_nodes = root_nodes,
+        .next_root = 0,
+        .depth = depth,
+        .table = hash_mb ? &table : NULL,
+    };
+
+    thread_count = MAX(thread_count, 1);
+    PerftWorker *workers = engine_alloc(_Alignof(PerftWorker), thread_count * sizeof(PerftWorker));
+    pthread_t *handles = engine_alloc(_Alignof(pthread_t), thread_count * sizeof(pthread_t));
+
+    u64 start = now_ms();
+    for(u32 i = 0; i < thread_count; i++) {
+        workers[i].job = &job;
+        if(pthread_create(&handles[i], NULL, perft_worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start perft thread %u\n", i);
+            exit(1);
+        }
+    }
+    for(u32 i = 0; i < thread_count; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    u64 elapsed = now_ms() - start;
+
+    u64 total = depth > 0 ? 0 : 1;
+    for(u32 i = 0; i < job.root_count; i++) {
+        char move[6];
+        move_to_string(root_moves[i], move);
+        printf("%s: %llu\n", move, (unsigned long long)root_nodes[i]);
+        total += root_nodes[i];
+    }
+    printf("\nNodes searched: %llu\n", (unsigned long long)total);
+    printf("Time: %llu ms, %llu nodes per second\n",
+        (unsigned long long)elapsed, (unsigned long long)(total * 1000 / MAX(elapsed, 1)));
+
+    free(handles);
+    free(workers);
+    free(table.entries);
+    return total;
+}
+
+// Fixed, varied positions for the bench command: openings, tactical
+// middlegames, the usual perft stress positions and a few endgames
+static const char *bench_positions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r3k2r/2pb1ppp/2pp1q2/p7/1nP1B3/1P2P3/P2N1PPP/R2QK2R w KQkq a6 0 14",
+    "4rrk1/2p1b1p1/p1p3q1/4p3/2P2n1p/1P1NR2P/PB3PP1/3R1QK1 b - - 2 24",
+    "r3qbrk/6p1/2b2pPp/p3pP1Q/PpPpP2P/3P1B2/2PB3K/R5R1 w - - 16 42",
+    "6k1/1R3p2/6p1/2Bp3p/3P2q1/P7/1P2rQ1K/5R2 b - - 4 44",
+    "7r/2p3k1/1p1p1qp1/1P1Bp3/p1P2r1P/P7/4R3/Q4RK1 w - - 0 36",
+    "8/8/1p2k1p1/3p3p/1p1P1P1P/1P2PK2/8/8 w - - 3 54",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 80",
+    "8/3k4/8/8/8/4K3/3P4/8 w - - 0 1",
+};
+
+#define BENCH_POSITION_COUNT (sizeof(bench_positions) / sizeof(bench_positions[0]))
+#define BENCH_DEFAULT_DEPTH 7
+
+// Searches every bench position from a cleared state and prints the node
+// count and speed of each. The total node count is the signature: with one
+// thread and a depth or node limit it depends only on the search code, so
+// it changes exactly when the search does
+u64 bench(const SearchLimits *limits) {
+    u64 total_nodes = 0;
+    u64 total_ms = 0;
+    for(u32 i = 0; i < BENCH_POSITION_COUNT; i++) {
+        Board b;
+        if(!board_from_fen(&b, bench_positions[i], NULL)) {
+            fprintf(stderr, "Invalid bench position %s\n", bench_positions[i]);
+            exit(1);
+        }
+
+        tt_clear();
+        threads_clear();
+        u64 start = now_ms();
+        threads_start(&b, limits, false);
+        SearchResult result = threads_wait();
+        u64 elapsed = now_ms() - start;
+        u64 nodes = threads_nodes();
+
+        char move[6];
+        move_to_string(result.move, move);
+        printf("Position %2u/%u: best %s, depth %d, %llu nodes, %llu ms, %llu nodes per second\n",
+            i + 1, (u32)BENCH_POSITION_COUNT, move, result.depth, (unsigned long long)nodes,
+            (unsigned long long)elapsed, (unsigned long long)(nodes * 1000 / MAX(elapsed, 1)));
+        total_nodes += nodes;
+        total_ms += elapsed;
+#ifdef SEARCH_STATS
+        if(show_stats) {
+            SearchStats stats;
+            threads_stats(&stats);
+            print_search_stats("", &stats);
+        }
+#endif
+    }
+
+    printf("\nTotal time: %llu ms\n", (unsigned long long)total_ms);
+    printf("Nodes per second: %llu\n", (unsigned long long)(total_nodes * 1000 / MAX(total_ms, 1)));
+    printf("Signature: %llu\n", (unsigned long long)total_nodes);
+    return total_nodes;
+}
+
+// Batch analysis of an EPD or FEN file, one position per line. Every
+// worker thread has its own search context and limit state and pulls the
+// next line from the shared file, so memory stays bounded however long the
+// file is. Only the transposition table is shared. Results are printed as
+// soon as each search finishes, tagged with the line they came from
+typedef struct {
+    FILE *file;
+    pthread_mutex_t input;
+    u64 line_number;
+    SearchLimits limits;
+
+    _Atomic u64 positions;
+    _Atomic u64 nodes;
+} EpdJob;
+
+typedef struct {
+    EpdJob *job;
+    SearchContext *ctx;
+    SearchShared shared;
+} EpdWorker;
+
+void *epd_worker_main(void *arg) {
+    EpdWorker *worker = arg;
+    EpdJob *job = worker->job;
+    SearchContext *ctx = worker->ctx;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    for(;;) {
+        pthread_mutex_lock(&job->input);
+        ssize_t length = getline(&line, &capacity, job->file);
+        u64 line_number = ++job->line_number;
+        pthread_mutex_unlock(&job->input);
+        if(length == -1) {
+            break;
+        }
+
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *text = line + strspn(line, " \t");
+        if(*text == '\0' || *text == '#') {
+            continue;
+        }
+        if(!board_from_fen(&ctx->board, text, NULL)) {
+            printf("%llu invalid position\n", (unsigned long long)line_number);
+            fflush(stdout);
+            continue;
+        }
+
+        worker->shared.limits = job->limits;
+        worker->shared.go_ms = now_ms();
+        atomic_store(&worker->shared.start_ms, worker->shared.go_ms);
+        atomic_store(&worker->shared.stop, false);
+        atomic_store(&worker->shared.nodes, 0);
+        atomic_store(&worker->shared.tb_hits, 0);
+        SearchResult result = search(ctx);
+        u64 elapsed = now_ms() - worker->shared.go_ms;
+
+        char fen[FEN_MAX_LENGTH];
+        char move[6] = "0000";
+        char score[32];
+        board_to_fen(&ctx->board, fen);
+        if(result.move != MOVE_NONE) {
+            move_to_string(result.move, move);
+        }
+        format_score(result.score, ctx->board.side_to_move, score, sizeof(score));
+        printf("%llu %s bestmove %s score %s depth %d nodes %llu time %llu\n",
+            (unsigned long long)line_number, fen, move, score, result.depth,
+            (unsigned long long)ctx->nodes, (unsigned long long)elapsed);
+        fflush(stdout);
+
+        atomic_fetch_add(&job->positions, 1);
+        atomic_fetch_add(&job->nodes, ctx->nodes);
+    }
+
+    free(line);
+    return NULL;
+}
+
+// Analyses every position in path on thread_count threads. Returns false if
+// the file cannot be opened
+bool analyse_epd(const char *path, const SearchLimits *limits, u32 thread_count) {
+    FILE *file = fopen(path, "r");
+    if(!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    EpdJob job = {
+        .file = file,
+        .input = PTHREAD_MUTEX_INITIALIZER,
+        .limits = *limits,
+    };
+
+    thread_count = MAX(thread_count, 1);
+    EpdWorker *workers = engine_alloc(_Alignof(EpdWorker), thread_count * sizeof(EpdWorker));
+    pthread_t *handles = engine_alloc(_Alignof(pthread_t), thread_count * sizeof(pthread_t));
+    memset(workers, 0, thread_count * sizeof(EpdWorker));
+
+    // One age for the whole run. Workers start positions while others are
+    // still searching, and bumping the age then would make their fresh
+    // entries look stale
+    tt_new_search();
+
+    u64 start = now_ms();
+    for(u32 i = 0; i < thread_count; i++) {
+        EpdWorker *worker = &workers[i];
+        worker->job = &job;
+        worker->ctx = engine_alloc(_Alignof(SearchContext), sizeof(SearchContext));
+        memset(worker->ctx, 0, sizeof(SearchContext));
+        // Every worker is the main thread of its own search
+        worker->ctx->shared = &worker->shared;
+        worker->ctx->thread_id = 0;
+        if(pthread_create(&handles[i], NULL, epd_worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start analysis thread %u\n", i);
+            exit(1);
+        }
+    }
+    for(u32 i = 0; i < thread_count; i++) {
+        pthread_join(handles[i], NULL);
+        free(workers[i].ctx);
+    }
+    u64 elapsed = now_ms() - start;
+
+    u64 positions = atomic_load(&job.positions);
+    u64 nodes = atomic_load(&job.nodes);
+    fprintf(stderr, "Analysed %llu positions in %llu ms, %llu nodes per second\n",
+        (unsigned long long)positions, (unsigned long long)elapsed,
+        (unsigned long long)(nodes * 1000 / MAX(elapsed, 1)));
+
+    free(handles);
+    free(workers);
+    fclose(file);
+    return true;
+}
+
+// Finds the legal move of b written in long algebraic notation, or
+// MOVE_NONE if there is none
+Move parse_move(Board *b, const char *text) {
+    Move moves[MAX_MOVES];
+    u32 count = generate_moves(b->side_to_move, moves, b);
+    for(u32 i = 0; i < count; i++) {
+        char move[6];
+        move_to_string(moves[i], move);
+        if(strcmp(move, text) == 0) {
+            return moves[i];
+        }
+    }
+    return MOVE_NONE;
+}
+
+// Opening book in the Polyglot .bin format: 16-byte big-endian entries of
+// key, move, weight and learn data, sorted by key. The file is mapped
+// rather than read, so opening a book costs the same whatever its size,
+// and a probe touches only the pages its binary search visits.
+//
+// Keys follow the Polyglot layout: 768 piece keys indexed by kind (black
+// pawn, white pawn, black knight, ... white king) and square, then four
+// castling keys, eight en passant file keys and the white-to-move key. The
+// published Polyglot random table is not embedded, the keys come from this
+// engine's generator instead. Books written by make-book work as is; books
+// from other tools need that table dropped into init_polyglot_keys
+#define POLYGLOT_CASTLING 768
+#define POLYGLOT_EP_FILE 772
+#define POLYGLOT_TURN 780
+#define POLYGLOT_KEY_COUNT 781
+#define BOOK_ENTRY_SIZE 16
+
+u64 polyglot_keys[POLYGLOT_KEY_COUNT];
+
+// Polyglot piece order, indexed by PieceType
+static const u32 polyglot_piece_order[PIECE_TYPE_COUNT] = {
+    [PAWN] = 0, [KNIGHT] = 1, [BISHOP] = 2, [ROOK] = 3, [QUEEN] = 4, [KING] = 5
+};
+
+void init_polyglot_keys(void) {
+    u64 state = 0x7A3C8D62E1F0B459;
+    for(u32 i = 0; i < POLYGLOT_KEY_COUNT; i++) {
+        polyglot_keys[i] = random_u64(&state);
+    }
+}
+
+u64 polyglot_key(const Board *b) {
+    u64 key = 0;
+    u64 occupied = b->pieces_state;
+    while(occupied) {
+        u32 square = pop_lsb(&occupied);
+        const Piece *piece = &b->pieces[square];
+        u32 kind = polyglot_piece_order[piece->type] * 2 + (piece->color == COLOR_WHITE);
+        key ^= polyglot_keys[kind * 64 + square];
+    }
+
+    // CASTLE_* bits are in Polyglot order already
+    for(u32 i = 0; i < 4; i++) {
+        if(b->castling_rights & (1 << i)) {
+            key ^= polyglot_keys[POLYGLOT_CASTLING + i];
+        }
+    }
+    // Polyglot hashes the en passant file only if a pawn can capture,
+    // which is exactly when the board keeps the square
+    if(b->ep_square != NO_SQUARE) {
+        key ^= polyglot_keys[POLYGLOT_EP_FILE + SQUARE_X(b->ep_square)];
+    }
+    if(b->side_to_move == COLOR_WHITE) {
+        key ^= polyglot_keys[POLYGLOT_TURN];
+    }
+    return key;
+}
+
+// Polyglot move: to square in bits 0-5, from square in bits 6-11 and the
+// promotion piece (1 knight to 4 queen) in bits 12-14. Castling is
+// written as the king capturing its own rook
+u16 polyglot_move(Move move) {
+    static const u16 promotion_codes[PIECE_TYPE_COUNT] = {
+        [KNIGHT] = 1, [BISHOP] = 2, [ROOK] = 3, [QUEEN] = 4
+    };
+
+    u32 from = MOVE_FROM(move);
+    u32 to = MOVE_TO(move);
+    u32 flags = MOVE_FLAGS(move);
+    if(flags == FLAG_KING_CASTLE) {
+        to = from + 3;
+    } else if(flags == FLAG_QUEEN_CASTLE) {
+        to = from - 4;
+    }
+    u16 code = to | (from << 6);
+    if(MOVE_IS_PROMOTION(move)) {
+        code |= promotion_codes[MOVE_PROMOTION_TYPE(move)] << 12;
+    }
+    return code;
+}
+
+typedef struct {
+    const u8 *data;
+    u64 entry_count;
+    size_t size;
+
+    bool enabled;
+    // Always play the highest weighted move instead of sampling by weight
+    bool best_move;
+    u64 rng;
+} Book;
+
+Book book = {.rng = 0x2545F4914F6CDD1D};
+
+void book_close(void) {
+    if(book.data) {
+        munmap((void *)book.data, book.size);
+    }
+    book.data = NULL;
+    book.size = 0;
+    book.entry_count = 0;
+}
+
+// Maps the book at path. Returns false, with no book open, if it cannot be
+bool book_open(const char *path) {
+    book_close();
+
+    i32 fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < BOOK_ENTRY_SIZE) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive
+    close(fd);
+    if(data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, st.st_size, MADV_RANDOM);
+
+    book.data = data;
+    book.size = st.st_size;
+    book.entry_count = st.st_size / BOOK_ENTRY_SIZE;
+    return true;
+}
+
+// Book move for b, or MOVE_NONE. Entries whose move is not legal here, as
+// can happen on a key collision, are ignored
+Move book_probe(Board *b) {
+    if(!book.enabled || !book.data) {
+        return MOVE_NONE;
+    }
+
+    // First entry with this key
+    u64 key = polyglot_key(b);
+    u64 low = 0;
+    u64 high = book.entry_count;
+    while(low < high) {
+        u64 middle = low + (high - low) / 2;
+        if(read_be(book.data + middle * BOOK_ENTRY_SIZE, 8) < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    Move legal[MAX_MOVES];
+    u32 legal_count = generate_moves(b->side_to_move, legal, b);
+
+    Move candidates[MAX_MOVES];
+    u32 weights[MAX_MOVES];
+    u32 count = 0;
+    u64 total = 0;
+    for(u64 i = low; i < book.entry_count && count < MAX_MOVES; i++) {
+        const u8 *entry = book.data + i * BOOK_ENTRY_SIZE;
+        if(read_be(entry, 8) != key) {
+            break;
+        }
+        u16 code = (u16)read_be(entry + 8, 2);
+        u32 weight = (u32)read_be(entry + 10, 2);
+        for(u32 j = 0; j < legal_count; j++) {
+            if(polyglot_move(legal[j]) == code && weight > 0) {
+                candidates[count] = legal[j];
+                weights[count] = weight;
+                total += weight;
+                count++;
+                break;
+            }
+        }
+    }
+    if(count == 0) {
+        return MOVE_NONE;
+    }
+
+    u32 chosen = 0;
+    if(book.best_move) {
+        for(u32 i = 1; i < count; i++) {
+            if(weights[i] > weights[chosen]) {
+                chosen = i;
+            }
+        }
+    } else {
+        u64 pick = random_u64(&book.rng) % total;
+        while(pick >= weights[chosen]) {
+            pick -= weights[chosen];
+            chosen++;
+        }
+    }
+    return candidates[chosen];
+}
+
+// One book move and the number of times it was played. A count of 0
+// marks a free slot of a worker's sample table
+typedef struct {
+    u64 key;
+    u16 move;
+    u32 count;
+} BookSample;
+
+static int compare_book_samples(const void *a, const void *b) {
+    const BookSample *x = a;
+    const BookSample *y = b;
+    if(x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return (i32)x->move - (i32)y->move;
+}
+
+static inline void write_be(u8 *p, u64 value, u32 bytes) {
+    for(u32 i = bytes; i-- > 0;) {
+        p[i] = (u8)value;
+        value >>= 8;
+    }
+}
+
+// Sorts samples and writes them to path as a Polyglot book, one entry per
+// distinct position and move, weighted by how often it was played. The
+// same move can come in once per worker, the counts are added up
+bool book_write(const char *path, BookSample *samples, u64 count) {
+    FILE *file = fopen(path, "wb");
+    if(!file) {
+        return false;
+    }
+
+    qsort(samples, count, sizeof(BookSample), compare_book_samples);
+    u64 entries = 0;
+    for(u64 i = 0; i < count;) {
+        u64 j = i;
+        u64 weight = 0;
+        while(j < count && samples[j].key == samples[i].key && samples[j].move == samples[i].move) {
+            weight += samples[j].count;
+            j++;
+        }
+        u8 entry[BOOK_ENTRY_SIZE] = {0};
+        write_be(entry, samples[i].key, 8);
+        write_be(entry + 8, samples[i].move, 2);
+        write_be(entry + 10, MIN(weight, UINT16_MAX), 2);
+        fwrite(entry, 1, sizeof(entry), file);
+        entries++;
+        i = j;
+    }
+
+    fprintf(stderr, "Wrote %llu book entries to %s\n", (unsigned long long)entries, path);
+    return fclose(file) == 0;
+}
+
+// Resolves a move in standard algebraic notation (e4, Nbd7, exd8=Q+, O-O)
+// against the legal moves of b. Check marks and annotations are ignored.
+// Returns MOVE_NONE unless exactly one legal move matches
+Move parse_san(Board *b, const char *san, size_t length) {
+    char text[16];
+    while(length > 0 && strchr("+#!?", san[length - 1])) {
+        length--;
+    }
+    if(length < 2 || length >= sizeof(text)) {
+        return MOVE_NONE;
+    }
+    memcpy(text, san, length);
+    text[length] = '\0';
+
+    Move moves[MAX_MOVES];
+    u32 count = generate_moves(b->side_to_move, moves, b);
+
+    if(text[0] == 'O' || text[0] == '0') {
+        u32 castle;
+        if(strcmp(text, "O-O") == 0 || strcmp(text, "0-0") == 0) {
+            castle = FLAG_KING_CASTLE;
+        } else if(strcmp(text, "O-O-O") == 0 || strcmp(text, "0-0-0") == 0) {
+            castle = FLAG_QUEEN_CASTLE;
+        } else {
+            return MOVE_NONE;
+        }
+        for(u32 i = 0; i < count; i++) {
+            if(MOVE_FLAGS(moves[i]) == castle) {
+                return moves[i];
+            }
+        }
+        return MOVE_NONE;
+    }
+
+    static const char piece_letters[PIECE_TYPE_COUNT] = {
+        [KING] = 'K', [PAWN] = 'P', [BISHOP] = 'B', [KNIGHT] = 'N', [ROOK] = 'R', [QUEEN] = 'Q'
+    };
+    u32 piece = PAWN;
+    u32 start = 0;
+    for(u32 type = 0; type < PIECE_TYPE_COUNT; type++) {
+        if(text[0] == piece_letters[type]) {
+            piece = type;
+            start = 1;
+        }
+    }
+
+    // Promotion, written e8=Q or e8Q. Some exporters write the piece in
+    // lowercase, which only counts right after the = or the last rank, so
+    // a file letter is never taken for a bishop
+    u32 promotion = PIECE_TYPE_COUNT;
+    if(piece == PAWN) {
+        char last = text[length - 1];
+        char before = text[length - 2];
+        if(last >= 'a' && last <= 'z' && (before == '=' || before == '1' || before == '8')) {
+            last -= 'a' - 'A';
+        }
+        for(u32 type = BISHOP; type < PIECE_TYPE_COUNT; type++) {
+            if(last == piece_letters[type]) {
+                promotion = type;
+                length -= text[length - 2] == '=' ? 2 : 1;
+            }
+        }
+    }
+
+    if(length < start + 2) {
+        return MOVE_NONE;
+    }
+    char to_file = text[length - 2];
+    char to_rank = text[length - 1];
+    if(to_file < 'a' || to_file > 'h' || to_rank < '1' || to_rank > '8') {
+        return MOVE_NONE;
+    }
+    u32 to = SQUARE(to_file - 'a', to_rank - '1');
+
+    // Whatever sits between the piece and the destination narrows the
+    // origin square down
+    i32 from_file = -1;
+    i32 from_rank = -1;
+    for(u32 i = start; i < length - 2; i++) {
+        if(text[i] >= 'a' && text[i] <= 'h') {
+            from_file = text[i] - 'a';
+        } else if(text[i] >= '1' && text[i] <= '8') {
+            from_rank = text[i] - '1';
+        } else if(text[i] != 'x' && text[i] != ':' && text[i] != '-') {
+            return MOVE_NONE;
+        }
+    }
+
+    Move found = MOVE_NONE;
+    for(u32 i = 0; i < count; i++) {
+        Move move = moves[i];
+        u32 from = MOVE_FROM(move);
+        if(MOVE_TO(move) != to || b->pieces[from].type != piece
+            || (from_file >= 0 && (i32)SQUARE_X(from) != from_file)
+            || (from_rank >= 0 && (i32)SQUARE_Y(from) != from_rank)) {
+            continue;
+        }
+        if(MOVE_IS_PROMOTION(move) ? (u32)MOVE_PROMOTION_TYPE(move) != promotion : promotion != PIECE_TYPE_COUNT) {
+            continue;
+        }
+        if(found != MOVE_NONE) {
+            return MOVE_NONE;
+        }
+        found = move;
+    }
+    return found;
+}
+
+// Streaming PGN reader. The main thread reads the file in fixed-size chunks
+// cut at game boundaries and queues them, worker threads parse and replay
+// the games in them. A fixed pool of chunk buffers bounds memory however
+// large the database is: the reader blocks while every buffer is queued
+#define PGN_CHUNK_SIZE (1 << 20)
+#define PGN_CHUNKS_PER_THREAD 2
+#define PGN_OUTPUT_SIZE (64 * 1024)
+#define PGN_FEN_TAG_SIZE 128
+#define MAKE_BOOK_PLIES 20
+
+typedef struct {
+    char *data;
+    size_t length;
+} PgnChunk;
+
+typedef struct {
+    PgnChunk *chunks;
+    u32 chunk_count;
+
+    // Queue of filled chunks in file order and stack of free ones
+    u32 *filled;
+    u32 filled_head;
+    u32 filled_count;
+    u32 *free_chunks;
+    u32 free_count;
+    bool done;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t filled_cond;
+    pthread_cond_t free_cond;
+
+    // Print every position reached as a FEN line
+    bool emit_positions;
+
+    // Collect the moves of the first book_plies plies for make-book
+    u32 book_plies;
+
+    // Worker states, kept until the book samples are merged
+    struct PgnGame **worker_games;
+    _Atomic u32 worker_count;
+
+    // Games are numbered in the order workers reach them, not file order
+    _Atomic u64 next_game_id;
+    _Atomic u64 games;
+    _Atomic u64 plies;
+    _Atomic u64 errors;
+    _Atomic u64 results[4];
+} PgnJob;
+
+enum {
+    PGN_WHITE_WINS,
+    PGN_BLACK_WINS,
+    PGN_DRAW,
+    PGN_UNKNOWN
+};
+
+// Per-worker game state, reset at every game
+typedef struct PgnGame {
+    Board board;
+    bool in_game;
+    bool started;
+    bool failed;
+    u32 result;
+    u32 plies;
+    char fen[PGN_FEN_TAG_SIZE];
+
+    // Comments and variations can span lines
+    bool in_comment;
+    u32 variation_depth;
+
+    // Book moves seen by this worker, an open addressing table keyed on
+    // position and move. Repeated moves only bump a count, so memory follows
+    // the number of distinct entries rather than the size of the input
+    BookSample *samples;
+    u64 sample_count;
+    u64 sample_capacity;
+
+    // Positions are batched here and written with one call, so lines of
+    // different workers never interleave
+    char output[PGN_OUTPUT_SIZE];
+    size_t output_length;
+    u64 game_id;
+} PgnGame;
+
+static inline u32 pgn_result(const char *text, size_t length) {
+    if(length == 3 && memcmp(text, "1-0", 3) == 0) {
+        return PGN_WHITE_WINS;
+    } else if(length == 3 && memcmp(text, "0-1", 3) == 0) {
+        return PGN_BLACK_WINS;
+    } else if(length == 7 && memcmp(text, "1/2-1/2", 7) == 0) {
+        return PGN_DRAW;
+    }
+    return PGN_UNKNOWN;
+}
+
+static inline void pgn_flush_output(PgnGame *game) {
+    fwrite(game->output, 1, game->output_length, stdout);
+    game->output_length = 0;
+}
+
+static inline void pgn_emit_position(PgnGame *game) {
+    if(game->output_length + FEN_MAX_LENGTH + 32 > PGN_OUTPUT_SIZE) {
+        pgn_flush_output(game);
+    }
+    char fen[FEN_MAX_LENGTH];
+    board_to_fen(&game->board, fen);
+    game->output_length += snprintf(game->output + game->output_length, PGN_OUTPUT_SIZE - game->output_length,
+        "%llu %u %s\n", (unsigned long long)game->game_id, game->plies, fen);
+}
+
+void pgn_end_game(PgnJob *job, PgnGame *game) {
+    if(game->in_game) {
+        atomic_fetch_add_explicit(&job->games, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&job->plies, game->plies, memory_order_relaxed);
+        atomic_fetch_add_explicit(&job->results[game->result], 1, memory_order_relaxed);
+        if(game->failed) {
+            atomic_fetch_add_explicit(&job->errors, 1, memory_order_relaxed);
+        }
+    }
+    game->in_game = false;
+    game->started = false;
+    game->failed = false;
+    game->result = PGN_UNKNOWN;
+    game->plies = 0;
+    game->fen[0] = '\0';
+    game->in_comment = false;
+    game->variation_depth = 0;
+}
+
+// Sets up the starting position on the first movetext token of a game
+void pgn_start_game(PgnJob *job, PgnGame *game) {
+    game->started = true;
+    game->in_game = true;
+    game->game_id = atomic_fetch_add_explicit(&job->next_game_id, 1, memory_order_relaxed);
+    if(game->fen[0]) {
+        if(!board_from_fen(&game->board, game->fen, NULL)) {
+            game->failed = true;
+            return;
+        }
+    } else {
+        memset(&game->board, 0, sizeof(game->board));
+        setup_board(&game->board);
+    }
+    if(job->emit_positions) {
+        pgn_emit_position(game);
+    }
+}
+
+static inline BookSample *pgn_sample_slot(BookSample *samples, u64 capacity, u64 key, u16 move) {
+    u64 mask = capacity - 1;
+    u64 i = (key ^ (move * 0x9E3779B97F4A7C15ull)) & mask;
+    while(samples[i].count && (samples[i].key != key || samples[i].move != move)) {
+        i = (i + 1) & mask;
+    }
+    return &samples[i];
+}
+
+void pgn_book_sample(PgnGame *game, Move move) {
+    // Kept at most half full, doubling as needed
+    if(2 * (game->sample_count + 1) > game->sample_capacity) {
+        u64 capacity = MAX(game->sample_capacity * 2, 4096);
+        BookSample *samples = engine_alloc(_Alignof(BookSample), capacity * sizeof(BookSample));
+        memset(samples, 0, capacity * sizeof(BookSample));
+        for(u64 i = 0; i < game->sample_capacity; i++) {
+            const BookSample *sample = &game->samples[i];
+            if(sample->count) {
+                *pgn_sample_slot(samples, capacity, sample->key, sample->move) = *sample;
             }
-            // Top right
-            x1 = x;
-            y1 = y;
-            while(x1 < 7 && y1 < 7) {
-                x1++;
-                y1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+        }
+        free(game->samples);
+        game->samples = samples;
+        game->sample_capacity = capacity;
+    }
+
+    u64 key = polyglot_key(&game->board);
+    u16 code = polyglot_move(move);
+    BookSample *sample = pgn_sample_slot(game->samples, game->sample_capacity, key, code);
+    if(!sample->count) {
+        *sample = (BookSample){.key = key, .move = code};
+        game->sample_count++;
+    }
+    if(sample->count < UINT32_MAX) {
+        sample->count++;
+    }
+}
+
+void pgn_tag(PgnGame *game, const char *line, const char *end) {
+    const char *name = line + 1;
+    const char *value = memchr(name, '"', end - name);
+    if(!value) {
+        return;
+    }
+    value++;
+    const char *value_end = memchr(value, '"', end - value);
+    if(!value_end) {
+        return;
+    }
+
+    size_t name_length = value - 1 - name;
+    if(name_length >= 4 && memcmp(name, "FEN ", 4) == 0) {
+        size_t length = MIN((size_t)(value_end - value), PGN_FEN_TAG_SIZE - 1);
+        memcpy(game->fen, value, length);
+        game->fen[length] = '\0';
+    } else if(name_length >= 7 && memcmp(name, "Result ", 7) == 0) {
+        game->result = pgn_result(value, value_end - value);
+    }
+}
+
+void pgn_movetext(PgnJob *job, PgnGame *game, const char *p, const char *end) {
+    while(p < end) {
+        if(game->in_comment) {
+            const char *close = memchr(p, '}', end - p);
+            if(!close) {
+                return;
             }
-            // Right
-            x1 = x;
-            y1 = y;
-            while(x1 < 7) {
-                x1++;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+            game->in_comment = false;
+            p = close + 1;
+            continue;
+        }
+        if(*p == '{') {
+            game->in_comment = true;
+            p++;
+            continue;
+        }
+        // Variations are skipped, and may nest
+        if(*p == '(') {
+            game->variation_depth++;
+            p++;
+            continue;
+        }
+        if(*p == ')') {
+            game->variation_depth -= game->variation_depth > 0;
+            p++;
+            continue;
+        }
+        if(*p == ';') {
+            return;
+        }
+        if(*p == ' ' || *p == '\t' || *p == '\r' || *p == '.') {
+            p++;
+            continue;
+        }
+
+        const char *token = p;
+        while(p < end && !strchr(" \t\r{}();", *p)) {
+            p++;
+        }
+        // A stray } or a NUL byte, which strchr also matches, would stop the
+        // token before it starts. Skip it and count the game as broken
+        if(p == token) {
+            game->failed = true;
+            p++;
+            continue;
+        }
+        size_t length = p - token;
+        if(game->variation_depth > 0 || *token == '$') {
+            continue;
+        }
+
+        u32 result = pgn_result(token, length);
+        if(result != PGN_UNKNOWN || (length == 1 && *token == '*')) {
+            if(!game->started) {
+                pgn_start_game(job, game);
             }
-            // Bottom right
-            x1 = x;
-            y1 = y;
-            while(x1 < 7 && y1 > 0) {
-                x1++;
-                y1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+            if(result != PGN_UNKNOWN) {
+                game->result = result;
             }
-            // Bottom
-            x1 = x;
-            y1 = y;
-            while(y1 > 0) {
-                y1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+            continue;
+        }
+
+        // Move numbers, possibly glued to the move as in 12.e4 or 12...Nf6.
+        // Digits without a dot are castling written with zeros
+        const char *digits = token;
+        while(digits < p && *digits >= '0' && *digits <= '9') {
+            digits++;
+        }
+        if(digits > token && digits < p && *digits == '.') {
+            while(digits < p && *digits == '.') {
+                digits++;
             }
-            // Bottom left
-            x1 = x;
-            y1 = y;
-            while(x1 > 0 && y1 > 0) {
-                x1--;
-                y1--;
-                Piece *next_piece = get_piece(x1, y1, b);
-                if(next_piece && next_piece->color == color_to_move) {
-                    break;
-                } else if(next_piece && next_piece->color != color_to_move) {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                    break;
-                } else {
-                    move.to.x = x1;
-                    move.to.y = y1;
-                    moves[i] = move;
-                    i++;
-                }
+            token = digits;
+            length = p - token;
+        } else if(digits == p) {
+            continue;
+        }
+        if(length == 0) {
+            continue;
+        }
+
+        if(!game->started) {
+            pgn_start_game(job, game);
+        }
+        if(game->failed) {
+            continue;
+        }
+        Move move = parse_san(&game->board, token, length);
+        if(move == MOVE_NONE) {
+            game->failed = true;
+            continue;
+        }
+        if(game->plies < job->book_plies) {
+            pgn_book_sample(game, move);
+        }
+        Undo undo;
+        make_move(move, &undo, &game->board);
+        game->plies++;
+        if(job->emit_positions) {
+            pgn_emit_position(game);
+        }
+    }
+}
+
+void pgn_parse_chunk(PgnJob *job, PgnGame *game, const char *data, size_t length) {
+    const char *p = data;
+    const char *end = data + length;
+    while(p < end) {
+        const char *line_end = memchr(p, '\n', end - p);
+        if(!line_end) {
+            line_end = end;
+        }
+
+        if(*p == '[' && !game->in_comment) {
+            // A tag after movetext begins the next game
+            if(game->started) {
+                pgn_end_game(job, game);
             }
-            break;
+            game->in_game = true;
+            pgn_tag(game, p, line_end);
+        } else if(*p != '%') {
+            pgn_movetext(job, game, p, line_end);
         }
-        default:
-        {
+        p = line_end + 1;
+    }
+    pgn_end_game(job, game);
+}
+
+void *pgn_worker_main(void *arg) {
+    PgnJob *job = arg;
+    PgnGame *game = engine_alloc(_Alignof(PgnGame), sizeof(PgnGame));
+    memset(game, 0, sizeof(*game));
+    game->result = PGN_UNKNOWN;
+    job->worker_games[atomic_fetch_add(&job->worker_count, 1)] = game;
+
+    pthread_mutex_lock(&job->mutex);
+    for(;;) {
+        while(job->filled_count == 0 && !job->done) {
+            pthread_cond_wait(&job->filled_cond, &job->mutex);
+        }
+        if(job->filled_count == 0) {
             break;
         }
+        u32 index = job->filled[job->filled_head];
+        job->filled_head = (job->filled_head + 1) % job->chunk_count;
+        job->filled_count--;
+        pthread_mutex_unlock(&job->mutex);
+
+        pgn_parse_chunk(job, game, job->chunks[index].data, job->chunks[index].length);
+        if(game->output_length) {
+            pgn_flush_output(game);
+        }
+
+        pthread_mutex_lock(&job->mutex);
+        job->free_chunks[job->free_count++] = index;
+        pthread_cond_signal(&job->free_cond);
     }
+    pthread_mutex_unlock(&job->mutex);
 
-    *move_count = i;
+    return NULL;
 }
 
-// out_moves must be size 256
-Move *generate_moves(i32 color_to_move, u32 *count, Board *b) {
-    // TODO: custom allocator
-    Move *out_moves = malloc(256 * sizeof(Move));
-    if(!out_moves) {
-        fprintf(stderr, "Failed to allocate 256 move buffer\n");
-        exit(-1);
-        return NULL;
+// Where the last complete game in data ends: the start of the last tag
+// line that follows movetext. 0 if there is none
+size_t pgn_last_boundary(const char *data, size_t length) {
+    bool tags_follow = false;
+    size_t boundary = 0;
+    size_t line_end = length;
+    while(line_end > 0) {
+        size_t line_start = line_end;
+        while(line_start > 0 && data[line_start - 1] != '\n') {
+            line_start--;
+        }
+
+        // Blank lines separate sections without ending them
+        size_t first = line_start;
+        while(first < line_end && (data[first] == ' ' || data[first] == '\r' || data[first] == '\t')) {
+            first++;
+        }
+        if(first < line_end) {
+            if(data[first] == '[') {
+                tags_follow = true;
+                boundary = line_start;
+            } else if(tags_follow) {
+                return boundary;
+            }
+        }
+        if(line_start == 0) {
+            break;
+        }
+        line_end = line_start - 1;
+    }
+    return 0;
+}
+
+// Replays every game in path on thread_count threads, printing statistics
+// and, with emit_positions, every position reached. With book_path the
+// moves of the first MAKE_BOOK_PLIES plies of every game are written there
+// as an opening book. Returns false if a file cannot be opened
+bool read_pgn(const char *path, u32 thread_count, bool emit_positions, const char *book_path) {
+    FILE *file = fopen(path, "rb");
+    if(!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
     }
-    u32 move_count = 0;
 
-    for(u32 x = 0; x < 8; x++) {
-        for(u32 y = 0; y < 8; y++) {
-            u32 m = 0;
-            generate_moves_for_piece(x, y, color_to_move, b, &out_moves[move_count], &m);
-            move_count += m;
+    thread_count = MAX(thread_count, 1);
+    PgnJob job = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .filled_cond = PTHREAD_COND_INITIALIZER,
+        .free_cond = PTHREAD_COND_INITIALIZER,
+        .emit_positions = emit_positions,
+        .book_plies = book_path ? MAKE_BOOK_PLIES : 0,
+    };
+    job.worker_games = engine_alloc(_Alignof(PgnGame *), thread_count * sizeof(PgnGame *));
+    job.chunk_count = thread_count * PGN_CHUNKS_PER_THREAD;
+    job.chunks = engine_alloc(_Alignof(PgnChunk), job.chunk_count * sizeof(PgnChunk));
+    job.filled = engine_alloc(_Alignof(u32), job.chunk_count * sizeof(u32));
+    job.free_chunks = engine_alloc(_Alignof(u32), job.chunk_count * sizeof(u32));
+    for(u32 i = 0; i < job.chunk_count; i++) {
+        job.chunks[i].data = engine_alloc(64, PGN_CHUNK_SIZE);
+        job.free_chunks[job.free_count++] = i;
+    }
+
+    pthread_t *handles = engine_alloc(_Alignof(pthread_t), thread_count * sizeof(pthread_t));
+    u64 start = now_ms();
+    for(u32 i = 0; i < thread_count; i++) {
+        if(pthread_create(&handles[i], NULL, pgn_worker_main, &job) != 0) {
+            fprintf(stderr, "Failed to start PGN thread %u\n", i);
+            exit(1);
         }
     }
 
-    if(count) {
-        *count = move_count;
+    // The partial game at the end of each chunk is carried into the next.
+    // A single game longer than a chunk is cut, and counted as an error
+    char *carry = engine_alloc(64, PGN_CHUNK_SIZE);
+    size_t carry_length = 0;
+    bool eof = false;
+    while(!eof || carry_length > 0) {
+        pthread_mutex_lock(&job.mutex);
+        while(job.free_count == 0) {
+            pthread_cond_wait(&job.free_cond, &job.mutex);
+        }
+        u32 index = job.free_chunks[--job.free_count];
+        pthread_mutex_unlock(&job.mutex);
+
+        PgnChunk *chunk = &job.chunks[index];
+        memcpy(chunk->data, carry, carry_length);
+        size_t length = carry_length;
+        if(!eof) {
+            length += fread(chunk->data + length, 1, PGN_CHUNK_SIZE - length, file);
+            eof = length < PGN_CHUNK_SIZE;
+        }
+
+        size_t cut = eof ? length : pgn_last_boundary(chunk->data, length);
+        if(cut == 0) {
+            cut = length;
+        }
+        carry_length = length - cut;
+        memcpy(carry, chunk->data + cut, carry_length);
+        chunk->length = cut;
+
+        pthread_mutex_lock(&job.mutex);
+        job.filled[(job.filled_head + job.filled_count) % job.chunk_count] = index;
+        job.filled_count++;
+        pthread_cond_signal(&job.filled_cond);
+        pthread_mutex_unlock(&job.mutex);
     }
 
-    return out_moves;
-}
+    pthread_mutex_lock(&job.mutex);
+    job.done = true;
+    pthread_cond_broadcast(&job.filled_cond);
+    pthread_mutex_unlock(&job.mutex);
+    for(u32 i = 0; i < thread_count; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    fflush(stdout);
+    u64 elapsed = now_ms() - start;
 
-// Check if side with specified color in check
-bool is_in_check(u32 color, Board *b) {
-    Move moves[256];
-
-    for(u32 x = 0; x < 8; x++) {
-        for(u32 y = 0; y < 8; y++) {
-            Piece *piece = get_piece(x, y, b);
-            if(piece && piece->color != color) {
-                u32 move_count = 0;
-                generate_moves_for_piece(x, y, piece->color, b, moves, &move_count);
-
-                for(u32 i = 0; i < move_count; i++) {
-                    Move *m = &moves[i];
-                    if(color == COLOR_WHITE) {
-                        if(m->to.x == b->white_king_pos.x
-                            && m->to.y == b->white_king_pos.y) {
-                            return true;
-                        }
-                    } else {
-                        if(m->to.x == b->black_king_pos.x
-                            && m->to.y == b->black_king_pos.y) {
-                            return true;
-                        }
-                    }
+    u64 games = atomic_load(&job.games);
+    fprintf(stderr, "Games: %llu (%llu white wins, %llu black wins, %llu draws, %llu unknown)\n",
+        (unsigned long long)games, (unsigned long long)atomic_load(&job.results[PGN_WHITE_WINS]),
+        (unsigned long long)atomic_load(&job.results[PGN_BLACK_WINS]),
+        (unsigned long long)atomic_load(&job.results[PGN_DRAW]),
+        (unsigned long long)atomic_load(&job.results[PGN_UNKNOWN]));
+    fprintf(stderr, "Plies: %llu, games with errors: %llu\n",
+        (unsigned long long)atomic_load(&job.plies), (unsigned long long)atomic_load(&job.errors));
+    fprintf(stderr, "Time: %llu ms, %llu games per minute\n",
+        (unsigned long long)elapsed, (unsigned long long)(games * 60000 / MAX(elapsed, 1)));
+
+    bool ok = true;
+    if(book_path) {
+        u64 sample_count = 0;
+        for(u32 i = 0; i < thread_count; i++) {
+            sample_count += job.worker_games[i]->sample_count;
+        }
+        BookSample *samples = engine_alloc(_Alignof(BookSample), MAX(sample_count, 1) * sizeof(BookSample));
+        u64 offset = 0;
+        for(u32 i = 0; i < thread_count; i++) {
+            const PgnGame *game = job.worker_games[i];
+            for(u64 j = 0; j < game->sample_capacity; j++) {
+                if(game->samples[j].count) {
+                    samples[offset++] = game->samples[j];
                 }
             }
         }
+        if(!book_write(book_path, samples, sample_count)) {
+            fprintf(stderr, "Cannot write %s\n", book_path);
+            ok = false;
+        }
+        free(samples);
     }
 
-    return false;
+    for(u32 i = 0; i < thread_count; i++) {
+        free(job.worker_games[i]->samples);
+        free(job.worker_games[i]);
+    }
+    free(job.worker_games);
+    for(u32 i = 0; i < job.chunk_count; i++) {
+        free(job.chunks[i].data);
+    }
+    free(carry);
+    free(handles);
+    free(job.free_chunks);
+    free(job.filled);
+    free(job.chunks);
+    fclose(file);
+    return ok;
 }
 
-i32 minimax(Board *b, i32 depth, i32 ply_from_root, i32 alpha, i32 beta, i32 who_to_move) {
-    minimax_count++;
+#define UCI_DEFAULT_MOVE_OVERHEAD 10
+#define UCI_DEFAULT_MOVES_TO_GO 30
 
-    if(depth == 0) {
-        return evaluate_board(b);
+// UCI front end. stdin is read on the main thread while the pool searches.
+// Every go starts a waiter thread that collects the result and prints
+// bestmove. During infinite and ponder searches the waiter holds bestmove
+// back until stop or ponderhit, as the protocol requires, even if the
+// search itself has already finished
+typedef struct {
+    Board board;
+
+    pthread_t waiter;
+    bool waiter_running;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t release;
+    bool hold;
+    // An infinite search keeps holding after ponderhit
+    bool infinite;
+
+    u64 move_overhead;
+    bool large_pages;
+} UciState;
+
+UciState uci = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .release = PTHREAD_COND_INITIALIZER,
+    .move_overhead = UCI_DEFAULT_MOVE_OVERHEAD,
+};
+
+void *uci_waiter_main(void *arg) {
+    (void)arg;
+    SearchResult result = threads_wait();
+
+    pthread_mutex_lock(&uci.mutex);
+    while(uci.hold) {
+        pthread_cond_wait(&uci.release, &uci.mutex);
     }
+    pthread_mutex_unlock(&uci.mutex);
 
-    u32 move_count = 0;
-    Move *minimax_moves = generate_moves(who_to_move, &move_count, b);
-
-    u32 moves_to_remove[256];
-    u32 moves_to_remove_counter = 0;
-
-    for(i32 i = move_count - 1; i >= 0; i--) {
-        Piece *p = get_piece(minimax_moves[i].to.x, minimax_moves[i].to.y, b);
-        bool piece_exists = p != NULL;
-        Piece p_copy;
-        if(p) {
-            p_copy = *p;
-        }
-        move_piece(
-            minimax_moves[i].from.x,
-            minimax_moves[i].from.y,
-            minimax_moves[i].to.x,
-            minimax_moves[i].to.y,
-            b);
-        if(is_in_check(who_to_move, b)) {
-            // Can't make a move that results in check of your king!
-            moves_to_remove[moves_to_remove_counter] = i;
-            moves_to_remove_counter++;
+#ifdef SEARCH_STATS
+    if(show_stats) {
+        SearchStats stats;
+        threads_stats(&stats);
+        print_search_stats("info string stats ", &stats);
+    }
+#endif
+
+    char best[6] = "0000";
+    char ponder[6] = "";
+    if(result.move != MOVE_NONE) {
+        move_to_string(result.move, best);
+        Move pv[2];
+        if(extract_pv(&uci.board, result.move, pv, 2) == 2) {
+            move_to_string(pv[1], ponder);
+        }
+    }
+    if(ponder[0]) {
+        printf("bestmove %s ponder %s\n", best, ponder);
+    } else {
+        printf("bestmove %s\n", best);
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+static inline void uci_release(bool keep_infinite) {
+    pthread_mutex_lock(&uci.mutex);
+    uci.hold = keep_infinite && uci.infinite;
+    pthread_cond_broadcast(&uci.release);
+    pthread_mutex_unlock(&uci.mutex);
+}
+
+// Stops any running search and waits until its bestmove has been printed.
+// The waiter of a search that ended on its own is joined here as well
+void uci_stop(void) {
+    if(!uci.waiter_running) {
+        return;
+    }
+    threads_stop();
+    uci_release(false);
+    pthread_join(uci.waiter, NULL);
+    uci.waiter_running = false;
+}
+
+// position [startpos | fen <fen>] [moves <move>...]
+void uci_position(char *args) {
+    char *moves = strstr(args, "moves");
+    if(moves) {
+        *moves = '\0';
+        moves += strlen("moves");
+    }
+
+    Board b;
+    if(strncmp(args, "startpos", 8) == 0) {
+        memset(&b, 0, sizeof(b));
+        setup_board(&b);
+    } else if(strncmp(args, "fen", 3) == 0) {
+        if(!board_from_fen(&b, args + 3, NULL)) {
+            printf("info string invalid fen\n");
+            fflush(stdout);
+            return;
         }
-        move_piece(
-            minimax_moves[i].to.x,
-            minimax_moves[i].to.y,
-            minimax_moves[i].from.x,
-            minimax_moves[i].from.y,
-            b);
-        if(piece_exists) {
-            set_piece(minimax_moves[i].to.x, minimax_moves[i].to.y, &p_copy, b);
+    } else {
+        return;
+    }
+
+    for(char *token = moves ? strtok(moves, " \t\n") : NULL; token; token = strtok(NULL, " \t\n")) {
+        Move move = parse_move(&b, token);
+        if(move == MOVE_NONE) {
+            printf("info string illegal move %s\n", token);
+            fflush(stdout);
+            break;
         }
+        Undo undo;
+        make_move(move, &undo, &b);
     }
+    memcpy(&uci.board, &b, sizeof(b));
+}
 
-    for(u32 i = 0; i < moves_to_remove_counter; i++) {
-        for(u32 j = moves_to_remove[i]; j < move_count - 1; j++) {
-            minimax_moves[j] = minimax_moves[j + 1];
+// go [wtime <ms>] [btime <ms>] [winc <ms>] [binc <ms>] [movestogo <n>]
+//    [movetime <ms>] [nodes <n>] [depth <n>] [infinite] [ponder]
+void uci_go(char *args) {
+    uci_stop();
+
+    SearchLimits limits = {0};
+    u64 time[2] = {0};
+    u64 increment[2] = {0};
+    u64 moves_to_go = 0;
+    bool infinite = false;
+    bool ponder = false;
+    for(char *token = strtok(args, " \t\n"); token; token = strtok(NULL, " \t\n")) {
+        if(strcmp(token, "infinite") == 0) {
+            infinite = true;
+            continue;
+        } else if(strcmp(token, "ponder") == 0) {
+            ponder = true;
+            continue;
+        }
+
+        char *value_text = strtok(NULL, " \t\n");
+        if(!value_text) {
+            break;
+        }
+        i64 value = MAX(strtoll(value_text, NULL, 10), 0);
+        if(strcmp(token, "wtime") == 0) {
+            time[COLOR_WHITE] = value;
+        } else if(strcmp(token, "btime") == 0) {
+            time[COLOR_BLACK] = value;
+        } else if(strcmp(token, "winc") == 0) {
+            increment[COLOR_WHITE] = value;
+        } else if(strcmp(token, "binc") == 0) {
+            increment[COLOR_BLACK] = value;
+        } else if(strcmp(token, "movestogo") == 0) {
+            moves_to_go = value;
+        } else if(strcmp(token, "movetime") == 0) {
+            limits.time_ms = value;
+        } else if(strcmp(token, "nodes") == 0) {
+            limits.nodes = value;
+        } else if(strcmp(token, "depth") == 0) {
+            limits.depth = value;
         }
-        move_count--;
     }
 
-    // Check capture moves first
-    u32 move_scores[256];
-    for(u32 i = 0; i < move_count; i++) {
-        if(minimax_moves[i].capture) {
-            move_scores[i] = 5;
+    // Spread the clock over the moves still to play and spend most of the
+    // increment, never getting closer to the flag than the move overhead
+    u32 us = uci.board.side_to_move;
+    if(!infinite && !limits.time_ms && time[us]) {
+        u64 budget = time[us] / (moves_to_go ? moves_to_go : UCI_DEFAULT_MOVES_TO_GO) + increment[us] * 3 / 4;
+        u64 available = time[us] > uci.move_overhead ? time[us] - uci.move_overhead : 1;
+        limits.time_ms = MAX(MIN(budget, available), 1);
+    } else if(limits.time_ms > uci.move_overhead) {
+        limits.time_ms -= uci.move_overhead;
+    }
+    if(infinite) {
+        limits = (SearchLimits){0};
+    }
+
+    // A book move needs no search. Infinite and ponder searches are left
+    // alone, since their bestmove has to wait for the GUI anyway
+    if(!infinite && !ponder) {
+        Move book_move = book_probe(&uci.board);
+        if(book_move != MOVE_NONE) {
+            char move[6];
+            move_to_string(book_move, move);
+            printf("bestmove %s\n", move);
+            fflush(stdout);
+            return;
+        }
+    }
+
+    uci.infinite = infinite;
+    uci.hold = infinite || ponder;
+    tt_new_search();
+    threads_start(&uci.board, &limits, ponder);
+    if(pthread_create(&uci.waiter, NULL, uci_waiter_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start the UCI waiter thread\n");
+        exit(1);
+    }
+    uci.waiter_running = true;
+}
+
+// setoption name <name> [value <value>]
+void uci_setoption(char *args) {
+    char *name = strstr(args, "name");
+    if(!name) {
+        return;
+    }
+    name += strlen("name");
+    while(*name == ' ') {
+        name++;
+    }
+    char *value = strstr(name, " value");
+    if(value) {
+        *value = '\0';
+        value += strlen(" value");
+        while(*value == ' ') {
+            value++;
+        }
+    }
+    // Trailing whitespace of the name
+    for(char *end = name + strlen(name); end > name && (end[-1] == ' ' || end[-1] == '\n'); end--) {
+        end[-1] = '\0';
+    }
+
+    // Tables can only change while no search is using them
+    uci_stop();
+    if(strcmp(name, "Hash") == 0 && value) {
+        tt_resize(strtoull(value, NULL, 10), uci.large_pages);
+    } else if(strcmp(name, "Threads") == 0 && value) {
+        threads_resize((u32)strtoul(value, NULL, 10));
+    } else if(strcmp(name, "Clear Hash") == 0) {
+        tt_clear();
+    } else if(strcmp(name, "Move Overhead") == 0 && value) {
+        uci.move_overhead = strtoull(value, NULL, 10);
+    } else if(strcmp(name, "QSearchChecks") == 0 && value) {
+        qsearch_checks = strncmp(value, "true", 4) == 0;
+    } else if(strcmp(name, "OwnBook") == 0 && value) {
+        book.enabled = strncmp(value, "true", 4) == 0;
+    } else if(strcmp(name, "BookBestMove") == 0 && value) {
+        book.best_move = strncmp(value, "true", 4) == 0;
+    } else if(strcmp(name, "BookFile") == 0 && value) {
+        value[strcspn(value, "\r\n")] = '\0';
+        if(!book_open(value)) {
+            printf("info string cannot open book %s\n", value);
+        }
+    } else if(strcmp(name, "SyzygyPath") == 0 && value) {
+        value[strcspn(value, "\r\n")] = '\0';
+        tb_init(value);
+        printf("info string found %u tablebases up to %u pieces\n", tb.count, tb.max_pieces);
+    } else if(strcmp(name, "SyzygyProbeDepth") == 0 && value) {
+        tb.probe_depth = (u32)strtoul(value, NULL, 10);
+    } else if(strcmp(name, "SyzygyProbeLimit") == 0 && value) {
+        tb_set_probe_limit((u32)strtoul(value, NULL, 10));
+    } else if(strcmp(name, "EvalFile") == 0 && value) {
+        value[strcspn(value, "\r\n")] = '\0';
+        if(nnue_load(value)) {
+            printf("info string loaded network %s, %s kernels\n", value, nnue.kernel);
         } else {
-            move_scores[i] = 1;
+            printf("info string cannot load network %s\n", value);
         }
+    } else if(strcmp(name, "UseNNUE") == 0 && value) {
+        nnue.enabled = nnue.loaded && strncmp(value, "true", 4) == 0;
+#ifdef SEARCH_STATS
+    } else if(strcmp(name, "SearchStats") == 0 && value) {
+        show_stats = strncmp(value, "true", 4) == 0;
+#endif
+    } else if(strcmp(name, "Ponder") != 0) {
+        printf("info string unknown option %s\n", name);
+        fflush(stdout);
     }
 
-    // Bubble sort
-    for(i32 i = 0; i < move_count; i++) {
-        u32 swaps = 0;
-        for(i32 j = 0; j < move_count - i - 1; j++) {
-            if(move_scores[j] < move_scores[j + 1]) {
-                Move temp = minimax_moves[j];
-                minimax_moves[j] = minimax_moves[j + 1];
-                minimax_moves[j + 1] = temp;
+    // A network switched on keeps the current position's accumulators from
+    // then on
+    if(nnue.enabled) {
+        nnue_refresh(&uci.board);
+    }
+}
 
-                u32 temp_score = move_scores[j];
-                move_scores[j] = move_scores[j + 1];
-                move_scores[j + 1] = temp_score;
+void uci_loop(bool large_pages) {
+    uci.large_pages = large_pages;
+    memset(&uci.board, 0, sizeof(uci.board));
+    setup_board(&uci.board);
+    pool.shared.report = true;
 
-                swaps = 1;
-            }
+    char *line = NULL;
+    size_t capacity = 0;
+    while(getline(&line, &capacity, stdin) != -1) {
+        char *command = line;
+        while(*command == ' ' || *command == '\t') {
+            command++;
+        }
+        char *args = command + strcspn(command, " \t\n");
+        if(*args) {
+            *args++ = '\0';
         }
 
-        if(!swaps) {
+        if(strcmp(command, "uci") == 0) {
+            printf("id name chess-engine\n");
+            printf("id author Alihene\n");
+            printf("option name Hash type spin default %d min 1 max 65536\n", TT_DEFAULT_MB);
+            printf("option name Threads type spin default 1 min 1 max 1024\n");
+            printf("option name Clear Hash type button\n");
+            printf("option name Ponder type check default false\n");
+            printf("option name Move Overhead type spin default %d min 0 max 5000\n", UCI_DEFAULT_MOVE_OVERHEAD);
+            printf("option name QSearchChecks type check default %s\n", qsearch_checks ? "true" : "false");
+            printf("option name OwnBook type check default %s\n", book.enabled ? "true" : "false");
+            printf("option name BookFile type string default <empty>\n");
+            printf("option name BookBestMove type check default %s\n", book.best_move ? "true" : "false");
+            printf("option name SyzygyPath type string default <empty>\n");
+            printf("option name SyzygyProbeDepth type spin default %u min 1 max 100\n", tb.probe_depth);
+            printf("option name SyzygyProbeLimit type spin default %u min 0 max %d\n", tb.probe_limit, TB_PIECES);
+            printf("option name EvalFile type string default <empty>\n");
+            printf("option name UseNNUE type check default %s\n", nnue.enabled ? "true" : "false");
+#ifdef SEARCH_STATS
+            printf("option name SearchStats type check default %s\n", show_stats ? "true" : "false");
+#endif
+            printf("uciok\n");
+        } else if(strcmp(command, "isready") == 0) {
+            printf("readyok\n");
+        } else if(strcmp(command, "ucinewgame") == 0) {
+            uci_stop();
+            tt_clear();
+            threads_clear();
+        } else if(strcmp(command, "position") == 0) {
+            uci_stop();
+            uci_position(args);
+        } else if(strcmp(command, "go") == 0) {
+            uci_go(args);
+        } else if(strcmp(command, "stop") == 0) {
+            uci_stop();
+        } else if(strcmp(command, "ponderhit") == 0) {
+            threads_ponderhit();
+            uci_release(true);
+        } else if(strcmp(command, "setoption") == 0) {
+            uci_setoption(args);
+        } else if(strcmp(command, "quit") == 0) {
             break;
         }
+        fflush(stdout);
     }
 
-    bool in_check = is_in_check(who_to_move, b);
-    if(move_count == 0 && in_check) {
-        free(minimax_moves);
-        return who_to_move == COLOR_WHITE ? INT_MIN : INT_MAX;
-    } else if(move_count == 0 && !in_check) {
-        free(minimax_moves);
-        return 0;
+    uci_stop();
+    free(line);
+}
+
+int main(int argc, char **argv) {
+    u64 hash_mb = TT_DEFAULT_MB;
+    bool large_pages = false;
+    u32 thread_count = 1;
+    i32 perft_depth = -1;
+    u64 perft_hash_mb = 0;
+    bool run_bench = false;
+    bool run_uci = false;
+    const char *epd_path = NULL;
+    const char *pgn_path = NULL;
+    bool pgn_positions = false;
+    const char *make_book_path = NULL;
+    const char *book_path = NULL;
+    bool book_best = false;
+    const char *syzygy_path = NULL;
+    const char *nnue_path = NULL;
+    SearchLimits limits = {0};
+    for(i32 i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--hash") == 0 && i + 1 < argc) {
+            hash_mb = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--large-pages") == 0) {
+            large_pages = true;
+        } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = (u32)strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            limits.depth = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) {
+            limits.nodes = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--movetime") == 0 && i + 1 < argc) {
+            limits.time_ms = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--qsearch-checks") == 0) {
+            qsearch_checks = true;
+        } else if(strcmp(argv[i], "--perft-hash") == 0 && i + 1 < argc) {
+            perft_hash_mb = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "perft") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            perft_depth = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "bench") == 0) {
+            run_bench = true;
+        } else if(strcmp(argv[i], "uci") == 0) {
+            run_uci = true;
+        } else if(strcmp(argv[i], "analyse-epd") == 0 && i + 1 < argc) {
+            epd_path = argv[++i];
+        } else if(strcmp(argv[i], "--pgn-positions") == 0) {
+            pgn_positions = true;
+        } else if(strcmp(argv[i], "--make-book") == 0 && i + 1 < argc) {
+            make_book_path = argv[++i];
+        } else if(strcmp(argv[i], "--book") == 0 && i + 1 < argc) {
+            book_path = argv[++i];
+        } else if(strcmp(argv[i], "--book-best") == 0) {
+            book_best = true;
+        } else if(strcmp(argv[i], "--stats") == 0) {
+#ifdef SEARCH_STATS
+            show_stats = true;
+#else
+            fprintf(stderr, "--stats needs a build with SEARCH_STATS\n");
+            return 1;
+#endif
+        } else if(strcmp(argv[i], "--syzygy") == 0 && i + 1 < argc) {
+            syzygy_path = argv[++i];
+        } else if(strcmp(argv[i], "--syzygy-depth") == 0 && i + 1 < argc) {
+            tb.probe_depth = (u32)strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--syzygy-limit") == 0 && i + 1 < argc) {
+            tb.probe_limit = (u32)strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--nnue") == 0 && i + 1 < argc) {
+            nnue_path = argv[++i];
+        } else if(strcmp(argv[i], "pgn") == 0 && i + 1 < argc) {
+            pgn_path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--hash <MB>] [--large-pages] [--threads <count>] [--depth <plies>] [--nodes <count>] [--movetime <ms>] [--qsearch-checks] [--book <file>] [--book-best] [--syzygy <dirs>] [--syzygy-depth <plies>] [--syzygy-limit <pieces>] [--nnue <file>] [--stats]\n", argv[0]);
+            fprintf(stderr, "       %s [--threads <count>] [--perft-hash <MB>] perft <depth>\n", argv[0]);
+            fprintf(stderr, "       %s [--hash <MB>] [--threads <count>] [--depth <plies>] [--nodes <count>] [--movetime <ms>] [--nnue <file>] [--stats] bench\n", argv[0]);
+            fprintf(stderr, "       %s [--hash <MB>] [--large-pages] [--threads <count>] [--qsearch-checks] [--book <file>] [--book-best] [--syzygy <dirs>] [--nnue <file>] [--stats] uci\n", argv[0]);
+            fprintf(stderr, "       %s [--hash <MB>] [--large-pages] [--threads <count>] [--depth <plies>] [--nodes <count>] [--movetime <ms>] [--syzygy <dirs>] [--nnue <file>] analyse-epd <file>\n", argv[0]);
+            fprintf(stderr, "       %s [--threads <count>] [--pgn-positions] [--make-book <file>] pgn <file>\n", argv[0]);
+            return 1;
+        }
+    }
+    if(!limits.depth && !limits.nodes && !limits.time_ms) {
+        limits.depth = run_bench ? BENCH_DEFAULT_DEPTH : 6;
     }
 
-    if(who_to_move == COLOR_WHITE) {
-        i32 max_eval = INT_MIN;
-        for(u32 i = 0; i < move_count; i++) {
-            Piece *p = get_piece(minimax_moves[i].to.x, minimax_moves[i].to.y, b);
-            bool piece_exists = p;
-            Piece p_copy;
-            if(p) {
-                p_copy = *p;
-            }
-            move_piece(
-                minimax_moves[i].from.x,
-                minimax_moves[i].from.y,
-                minimax_moves[i].to.x,
-                minimax_moves[i].to.y,
-                b);
-            i32 eval = minimax(b, depth - 1, ply_from_root + 1, alpha, beta, COLOR_BLACK);
-            if(eval > max_eval && ply_from_root == 0) {
-                best_move = minimax_moves[i];
-            }
-            max_eval = MAX(max_eval, eval);
-            move_piece(
-                minimax_moves[i].to.x,
-                minimax_moves[i].to.y,
-                minimax_moves[i].from.x,
-                minimax_moves[i].from.y,
-                b);
-            if(piece_exists) {
-                set_piece(minimax_moves[i].to.x, minimax_moves[i].to.y, &p_copy, b);
-            }
-            alpha = MAX(alpha, eval);
-            if(eval >= beta) {
-                break;
-            }
+    init_attack_tables();
+    init_zobrist_keys();
+    init_polyglot_keys();
+    init_tablebase_tables();
+    init_nnue_kernels();
+
+    if(nnue_path) {
+        if(!nnue_load(nnue_path)) {
+            fprintf(stderr, "Cannot load network %s\n", nnue_path);
+            return 1;
         }
-        free(minimax_moves);
-        return max_eval;
-    } else {
-        i32 min_eval = INT_MAX;
-        for(u32 i = 0; i < move_count; i++) {
-            Piece *p = get_piece(minimax_moves[i].to.x, minimax_moves[i].to.y, b);
-            bool piece_exists = p;
-            Piece p_copy;
-            if(p) {
-                p_copy = *p;
-            }
-            move_piece(
-                minimax_moves[i].from.x,
-                minimax_moves[i].from.y,
-                minimax_moves[i].to.x,
-                minimax_moves[i].to.y,
-                b);
-            i32 eval = minimax(b, depth - 1, ply_from_root + 1, alpha, beta, COLOR_WHITE);
-            if(eval < min_eval && ply_from_root == 0) {
-                best_move = minimax_moves[i];
-            }
-            min_eval = MIN(min_eval, eval);
-            move_piece(
-                minimax_moves[i].to.x,
-                minimax_moves[i].to.y,
-                minimax_moves[i].from.x,
-                minimax_moves[i].from.y,
-                b);
-            if(piece_exists) {
-                set_piece(minimax_moves[i].to.x, minimax_moves[i].to.y, &p_copy, b);
-            }
-            beta = MIN(beta, eval);
-            if(eval <= alpha) {
-                break;
-            }
+        printf("Loaded network %s, %s kernels\n", nnue_path, nnue.kernel);
+    }
+
+    if(syzygy_path) {
+        tb_init(syzygy_path);
+        printf("Found %u tablebases up to %u pieces\n", tb.count, tb.max_pieces);
+    }
+
+    if(book_path) {
+        if(!book_open(book_path)) {
+            fprintf(stderr, "Cannot open book %s\n", book_path);
+            return 1;
         }
-        free(minimax_moves);
-        return min_eval;
+        book.enabled = true;
+        book.best_move = book_best;
     }
-}
 
-int main() {
+    Board board = {0};
     setup_board(&board);
-    memcpy(&search_board, &board, sizeof(board));
+
+    if(pgn_path) {
+        return read_pgn(pgn_path, thread_count, pgn_positions, make_book_path) ? 0 : 1;
+    }
+
+    if(perft_depth >= 0) {
+        perft_divide(&board, MIN(perft_depth, MAX_PLY), thread_count, perft_hash_mb);
+        return 0;
+    }
+
+    tt_resize(hash_mb, large_pages);
+
+    // Batch analysis runs its own workers instead of the search pool
+    if(epd_path) {
+        bool ok = analyse_epd(epd_path, &limits, thread_count);
+        free(tt.buckets);
+        return ok ? 0 : 1;
+    }
+
+    threads_resize(thread_count);
+
+    if(run_uci) {
+        uci_loop(large_pages);
+        threads_free();
+        free(tt.buckets);
+        return 0;
+    }
+
+    if(run_bench) {
+        bench(&limits);
+        threads_free();
+        free(tt.buckets);
+        return 0;
+    }
 
     for(u32 i = 0; i < 50; i++) {
-        minimax(&search_board, 6, 0, INT_MIN, INT_MAX, i % 2);
-        move_piece(best_move.from.x, best_move.from.y, best_move.to.x, best_move.to.y, &board);
-        memcpy(&search_board, &board, sizeof(board));
+        // Book moves are played without searching
+        Move book_move = book_probe(&board);
+        if(book_move != MOVE_NONE) {
+            char move[6];
+            move_to_string(book_move, move);
+            Undo undo;
+            make_move(book_move, &undo, &board);
+            printf("Half move %u\n", i + 1);
+            printf("Book move %s\n", move);
+            print_board(&board);
+            continue;
+        }
+
+        u64 allocations_before = allocation_count;
+        tt_new_search();
+        u64 start = now_ms();
+        threads_start(&board, &limits, false);
+        SearchResult result = threads_wait();
+        u64 elapsed = now_ms() - start;
+        u64 search_allocations = allocation_count - allocations_before;
+        if(result.move == MOVE_NONE) {
+            printf("No legal moves left\n");
+            break;
+        }
+
+        u64 nodes = threads_nodes();
+        u64 tt_probes = 0;
+        u64 tt_hits = 0;
+        for(u32 t = 0; t < pool.count; t++) {
+            tt_probes += pool.contexts[t]->tt_probes;
+            tt_hits += pool.contexts[t]->tt_hits;
+        }
+
+        Undo undo;
+        make_move(result.move, &undo, &board);
         printf("Half move %u\n", i + 1);
-        printf("Evaluated %u positions\n", minimax_count);
-        minimax_count = 0;
+        printf("Evaluated %llu positions on %u threads, %llu nodes per second\n",
+            (unsigned long long)nodes, pool.count, (unsigned long long)(nodes * 1000 / MAX(elapsed, 1)));
+        printf("Reached depth %d, score %d\n", result.depth, result.score);
+        printf("Heap allocations during search: %llu\n", (unsigned long long)search_allocations);
+        printf("Transposition table: %.1f%% hits, hashfull %u\n",
+            tt_probes ? 100.0 * tt_hits / tt_probes : 0.0, tt_hashfull());
+        if(tb.count) {
+            printf("Tablebase hits: %llu\n", (unsigned long long)atomic_load(&pool.shared.tb_hits));
+        }
+#ifdef SEARCH_STATS
+        if(show_stats) {
+            SearchStats stats;
+            threads_stats(&stats);
+            print_search_stats("", &stats);
+        }
+#endif
         print_board(&board);
     }
 
+    threads_free();
+    book_close();
+    tb_free();
+    nnue_free();
+    free(tt.buckets);
+
     return 0;
-}
\ No newline at end of file
+}